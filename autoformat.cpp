@@ -0,0 +1,141 @@
+#include <algorithm>
+#include <limits>
+#include <vector>
+#include "autoformat.h"
+#include "common.h"
+#include "imagecontainer.h"
+#include "metrics.h"
+#include "threadpool.h"
+
+namespace {
+
+struct Candidate {
+	int textureType = 0;
+	int size = 0;
+	bool lossless = false;	// Known to be exact without measuring it
+	double psnr = 0;
+	std::string texture;
+	Palette palette;
+};
+
+}
+
+// Whether every pixel of every level survives conversion to the 16-bit format
+static bool isExactIn(const ImageContainer& images, int pixelFormat) {
+	for (int i=0; i<images.imageCount(); i++) {
+		const Image& img = images.getByIndex(i);
+		const RGBA* px = img.data();
+		for (int j=0; j<img.width()*img.height(); j++) {
+			RGBA c = to32BPP(to16BPP(px[j], pixelFormat), pixelFormat);
+			if (c.r != px[j].r || c.g != px[j].g || c.b != px[j].b || c.a != px[j].a)
+				return false;
+		}
+	}
+	return true;
+}
+
+// Whether every color survives being saved in the palette format
+static bool isExactInPalette(const Palette& colors) {
+	Palette rounded = colors;
+	rounded.quantize(g_paletteOptions.format);
+	if (rounded.colorCount() != colors.colorCount())
+		return false;
+	for (int i=0; i<colors.colorCount(); i++)
+		if (rounded.colorAt(i) != colors.colorAt(i)) return false;
+	return true;
+}
+
+static bool hasTransparency(const ImageContainer& images) {
+	for (int i=0; i<images.imageCount(); i++) {
+		const Image& img = images.getByIndex(i);
+		const RGBA* px = img.data();
+		for (int j=0; j<img.width()*img.height(); j++)
+			if (px[j].a != 255) return true;
+	}
+	return false;
+}
+
+bool chooseFormat(const ImageContainer& images, int flags, double minPSNR, AutoFormat& result) {
+	const bool strided = (flags & FLAG_STRIDED);
+	const bool transparent = hasTransparency(images);
+
+	std::vector<int> formats;
+	if (transparent) {
+		formats.push_back(PIXELFORMAT_ARGB1555);
+		formats.push_back(PIXELFORMAT_ARGB4444);
+	} else {
+		formats.push_back(PIXELFORMAT_RGB565);
+	}
+	if (!strided) {
+		formats.push_back(PIXELFORMAT_PAL4BPP);
+		formats.push_back(PIXELFORMAT_PAL8BPP);
+	}
+
+	std::vector<Candidate> candidates;
+	for (int format : formats) {
+		for (int compressed=0; compressed<=(strided ? 0 : 1); compressed++) {
+			Candidate c;
+			c.textureType = flags | (format << PIXELFORMAT_SHIFT) | (compressed ? FLAG_COMPRESSED : 0);
+			if (!isValidSize(images.width(), images.height(), c.textureType))
+				continue;
+			c.size = calculateSize(images.width(), images.height(), c.textureType);
+			candidates.push_back(std::move(c));
+		}
+	}
+	if (candidates.empty())
+		return false;
+
+	// Cheap checks first: few enough colors make a paletted texture exact if
+	// the palette format holds them, and so can colors that fit a 16-bit
+	// format. Nothing as big as the smallest exact texture can beat it, so
+	// those candidates are never converted.
+	Palette colors;
+	const int colorCount = (colors.census(images, 256) && isExactInPalette(colors)) ? colors.colorCount() : 257;
+	int smallestLossless = std::numeric_limits<int>::max();
+	for (auto& c : candidates) {
+		if (c.textureType & FLAG_COMPRESSED)
+			continue;
+		if (isFormat(c.textureType, PIXELFORMAT_PAL4BPP))
+			c.lossless = (colorCount <= 16);
+		else if (isFormat(c.textureType, PIXELFORMAT_PAL8BPP))
+			c.lossless = (colorCount <= 256);
+		else
+			c.lossless = isExactIn(images, (c.textureType >> PIXELFORMAT_SHIFT) & PIXELFORMAT_MASK);
+		if (c.lossless)
+			smallestLossless = std::min(smallestLossless, c.size);
+	}
+	candidates.erase(std::remove_if(candidates.begin(), candidates.end(), [&](const Candidate& c) {
+		return c.size > smallestLossless || (c.size == smallestLossless && !c.lossless);
+	}), candidates.end());
+
+	ThreadPool::global().parallelFor((int)candidates.size(), [&](int i) {
+		Candidate& c = candidates[i];
+		c.texture = encodeTexture(images, c.textureType, c.palette);
+		if (c.lossless) {
+			c.psnr = std::numeric_limits<double>::infinity();
+			return;
+		}
+		std::vector<LevelMetrics> metrics;
+		const Palette* palette = isPaletted(c.textureType) ? &c.palette : nullptr;
+		if (measureTexture((const uint8_t*)c.texture.data(), c.texture.size(), palette, images, false, metrics))
+			c.psnr = overallPSNR(metrics);
+	});
+
+	// The smallest good enough texture, or else the best one
+	Candidate* best = nullptr;
+	for (auto& c : candidates) {
+		if (c.psnr < minPSNR) continue;
+		if (!best || c.size < best->size || (c.size == best->size && c.psnr > best->psnr))
+			best = &c;
+	}
+	if (!best) {
+		for (auto& c : candidates)
+			if (!best || c.psnr > best->psnr) best = &c;
+	}
+
+	result.textureType = best->textureType;
+	result.psnr = best->psnr;
+	result.texture = std::move(best->texture);
+	result.palette = std::move(best->palette);
+	return true;
+}
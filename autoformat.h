@@ -0,0 +1,22 @@
+#pragma once
+
+#include <string>
+#include "palette.h"
+
+class ImageContainer;
+
+// The texture picked by chooseFormat()
+struct AutoFormat {
+	int textureType = 0;
+	double psnr = 0;		// Of all levels together, infinity if lossless
+	std::string texture;	// The whole texture file, header included
+	Palette palette;		// Only for paletted textures
+};
+
+// Converts the images to every format allowed by 'flags' (FLAG_MIPMAPPED, or
+// FLAG_STRIDED with its stride setting) and picks the smallest texture with
+// a PSNR of at least minPSNR, or the one with the best PSNR if none is good
+// enough. The candidates are RGB565 (ARGB1555 and ARGB4444 instead for
+// images with transparency), PAL4BPP and PAL8BPP, each also compressed.
+// Returns false if no candidate can hold images of this size.
+bool chooseFormat(const ImageContainer& images, int flags, double minPSNR, AutoFormat& result);
@@ -0,0 +1,366 @@
+// Benchmark of the converters on synthetic images. Every image kind, size,
+// format and mode is converted in memory and reported with its speed, its
+// peak memory use and a hash of the texture, so runs can be compared for
+// both speed and output. Each case runs in a child process of its own, so
+// its peak memory use isn't hidden by that of a larger case before it.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "common.h"
+#include "image.h"
+#include "imagecontainer.h"
+#include "log.h"
+#include "palette.h"
+
+namespace {
+
+// Small deterministic generator, so the images are the same on every platform
+class Random {
+public:
+	explicit Random(uint32_t seed) : state(seed * 2654435761u + 1) {}
+	uint32_t next() {
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		return state;
+	}
+	uint8_t byte() { return (uint8_t)(next() >> 24); }
+
+private:
+	uint32_t state;
+};
+
+uint8_t clampByte(float v) {
+	return (uint8_t)std::max(0.0f, std::min(255.0f, v + 0.5f));
+}
+
+Image gradient(int w, int h, uint32_t) {
+	Image img(w, h);
+	for (int y=0; y<h; y++) {
+		for (int x=0; x<w; x++) {
+			float fx = (w > 1) ? (float)x / (w - 1) : 0;
+			float fy = (h > 1) ? (float)y / (h - 1) : 0;
+			img.setPixel(x, y, { clampByte(fx * 255), clampByte(fy * 255), clampByte((1 - fx) * fy * 255), 255 });
+		}
+	}
+	return img;
+}
+
+Image noise(int w, int h, uint32_t seed) {
+	Random random(seed);
+	Image img(w, h);
+	for (int y=0; y<h; y++)
+		for (int x=0; x<w; x++)
+			img.setPixel(x, y, { random.byte(), random.byte(), random.byte(), 255 });
+	return img;
+}
+
+// Smooth value noise over a few octaves with some grain on top, which has
+// the soft edges and detail at every scale of a photo.
+Image photo(int w, int h, uint32_t seed) {
+	Random random(seed);
+	const int GRID = 9;
+	std::vector<float> lattice[3];
+	for (auto& channel : lattice) {
+		channel.resize(GRID * GRID);
+		for (float& v : channel) v = random.byte();
+	}
+
+	auto sample = [&](const std::vector<float>& channel, float u, float v) {
+		u -= std::floor(u); v -= std::floor(v);
+		float gx = u * (GRID - 1), gy = v * (GRID - 1);
+		int x0 = std::min((int)gx, GRID - 2), y0 = std::min((int)gy, GRID - 2);
+		float tx = gx - x0, ty = gy - y0;
+		tx = tx * tx * (3 - 2 * tx);
+		ty = ty * ty * (3 - 2 * ty);
+		float top = channel[y0*GRID+x0] + (channel[y0*GRID+x0+1] - channel[y0*GRID+x0]) * tx;
+		float bottom = channel[(y0+1)*GRID+x0] + (channel[(y0+1)*GRID+x0+1] - channel[(y0+1)*GRID+x0]) * tx;
+		return top + (bottom - top) * ty;
+	};
+
+	Image img(w, h);
+	for (int y=0; y<h; y++) {
+		for (int x=0; x<w; x++) {
+			float u = (float)x / w, v = (float)y / h;
+			float c[3];
+			for (int i=0; i<3; i++) {
+				c[i] = 0.6f * sample(lattice[i], u, v)
+					 + 0.3f * sample(lattice[(i+1)%3], u * 3, v * 3)
+					 + 0.1f * sample(lattice[(i+2)%3], u * 9, v * 9);
+			}
+			float grain = (int)(random.next() >> 28) - 8;
+			img.setPixel(x, y, { clampByte(c[0] + grain), clampByte(c[1] + grain), clampByte(c[2] + grain), 255 });
+		}
+	}
+	return img;
+}
+
+// Flat panels, buttons and borders in a handful of colors on a transparent
+// background, like a user interface
+Image flatUI(int w, int h, uint32_t seed) {
+	static const RGBA colors[] = {
+		{  32,  40,  64, 255 }, { 200, 200, 210, 255 }, { 255, 160,   0, 255 },
+		{  40, 140, 220, 255 }, { 255, 255, 255, 255 }, {  20,  20,  20, 255 },
+	};
+	const int colorCount = sizeof(colors) / sizeof(colors[0]);
+	Random random(seed);
+	Image img(w, h);
+	for (int y=0; y<h; y++)
+		for (int x=0; x<w; x++)
+			img.setPixel(x, y, { 0, 0, 0, 0 });
+
+	for (int panel=0; panel<12; panel++) {
+		int x0 = random.next() % w, y0 = random.next() % h;
+		int x1 = std::min(w, x0 + 1 + (int)(random.next() % std::max(1, w / 2)));
+		int y1 = std::min(h, y0 + 1 + (int)(random.next() % std::max(1, h / 3)));
+		RGBA fill = colors[random.next() % colorCount];
+		RGBA border = colors[random.next() % colorCount];
+		for (int y=y0; y<y1; y++)
+			for (int x=x0; x<x1; x++)
+				img.setPixel(x, y, (x == x0 || y == y0 || x == x1-1 || y == y1-1) ? border : fill);
+	}
+	return img;
+}
+
+struct ImageKind {
+	const char* name;
+	Image (*generate)(int w, int h, uint32_t seed);
+};
+
+const ImageKind imageKinds[] = {
+	{ "gradient", gradient },
+	{ "noise",    noise },
+	{ "photo",    photo },
+	{ "ui",       flatUI },
+};
+
+struct Format {
+	const char* name;
+	int pixelFormat;
+};
+
+const Format formats[] = {
+	{ "ARGB1555", PIXELFORMAT_ARGB1555 },
+	{ "RGB565",   PIXELFORMAT_RGB565 },
+	{ "ARGB4444", PIXELFORMAT_ARGB4444 },
+	{ "YUV422",   PIXELFORMAT_YUV422 },
+	{ "BUMPMAP",  PIXELFORMAT_BUMPMAP },
+	{ "PAL4BPP",  PIXELFORMAT_PAL4BPP },
+	{ "PAL8BPP",  PIXELFORMAT_PAL8BPP },
+};
+
+const char* modes[] = { "plain", "mipmap", "compress", "stride" };
+
+struct Options {
+	std::vector<int> sizes = { 8, 32, 128, 512, 1024 };
+	std::vector<std::string> kinds, formats, modes;	// Empty for all
+	int repeat = 1;
+};
+
+bool selected(const std::vector<std::string>& list, const std::string& name) {
+	return list.empty() || std::find(list.begin(), list.end(), name) != list.end();
+}
+
+std::vector<std::string> splitList(const std::string& list) {
+	std::vector<std::string> items;
+	std::stringstream ss(list);
+	std::string item;
+	while (std::getline(ss, item, ','))
+		if (!item.empty()) items.push_back(item);
+	return items;
+}
+
+uint64_t fnv1a(const void* data, size_t size, uint64_t hash = 14695981039346656037ull) {
+	const uint8_t* bytes = (const uint8_t*)data;
+	for (size_t i=0; i<size; i++) {
+		hash ^= bytes[i];
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+struct CaseResult {
+	double seconds = 0;		// Of the fastest repetition
+	uint64_t hash = 0;		// Of the texture and its palette
+};
+
+// Generates the image of a case and converts it 'repeat' times
+bool runCase(const ImageKind& kind, int width, int height, int seed, int textureType, int repeat, CaseResult& result) {
+	const Image source = kind.generate(width, height, (uint32_t)seed);
+	const int mipmapFilter = isPaletted(textureType) ? NEAREST : BOX;
+
+	// The best of the repetitions, which is the least disturbed
+	std::string texture;
+	Palette palette;
+	for (int r=0; r<repeat; r++) {
+		auto start = std::chrono::steady_clock::now();
+		ImageContainer images;
+		if (!images.loadImages({ source }, textureType, mipmapFilter))
+			return false;
+		palette = Palette();
+		texture = encodeTexture(images, textureType, palette);
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		if (r == 0 || seconds < result.seconds) result.seconds = seconds;
+	}
+
+	result.hash = fnv1a(texture.data(), texture.size());
+	for (int i=0; i<palette.colorCount(); i++) {
+		uint32_t color = palette.colorAt(i);
+		result.hash = fnv1a(&color, sizeof(color), result.hash);
+	}
+	return true;
+}
+
+// Runs 'work' in a child process and passes its result back through a pipe.
+// 'peakMB' receives the peak RSS of the child alone, from wait4().
+template<typename Work>
+bool runInChild(Work work, CaseResult& result, double& peakMB) {
+	int fds[2];
+	if (pipe(fds) != 0)
+		return false;
+	std::fflush(stdout);
+	pid_t pid = fork();
+	if (pid < 0) {
+		close(fds[0]);
+		close(fds[1]);
+		return false;
+	}
+	if (pid == 0) {
+		close(fds[0]);
+		CaseResult childResult;
+		bool ok = work(childResult) && write(fds[1], &childResult, sizeof(childResult)) == (ssize_t)sizeof(childResult);
+		_exit(ok ? 0 : 1);
+	}
+
+	close(fds[1]);
+	ssize_t received = read(fds[0], &result, sizeof(result));
+	close(fds[0]);
+	int status = 0;
+	struct rusage usage;
+	if (wait4(pid, &status, 0, &usage) != pid)
+		return false;
+	peakMB = usage.ru_maxrss / 1024.0;	// Kilobytes on Linux
+	return received == (ssize_t)sizeof(result) && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// The texture type for a mode, or -1 if the mode doesn't apply to the format
+int textureTypeFor(int pixelFormat, const std::string& mode) {
+	const bool paletted = (pixelFormat == PIXELFORMAT_PAL4BPP || pixelFormat == PIXELFORMAT_PAL8BPP);
+	int textureType = pixelFormat << PIXELFORMAT_SHIFT;
+	if (mode == "mipmap") {
+		textureType |= FLAG_MIPMAPPED;
+	} else if (mode == "compress") {
+		textureType |= FLAG_COMPRESSED;
+	} else if (mode == "stride") {
+		if (paletted || pixelFormat == PIXELFORMAT_BUMPMAP)
+			return -1;
+		textureType |= FLAG_STRIDED | FLAG_NONTWIDDLED;
+	}
+	return textureType;
+}
+
+void printUsage() {
+	std::cout << "Usage: texbench [--sizes 8,32,...] [--kinds gradient,noise,photo,ui]\n"
+				 "                [--formats RGB565,PAL8BPP,...] [--modes plain,mipmap,compress,stride]\n"
+				 "                [--repeat n]\n";
+}
+
+bool parseOptions(int argc, char* argv[], Options& opts) {
+	for (int i=1; i<argc; i++) {
+		std::string arg = argv[i];
+		if (i+1 >= argc) {
+			printUsage();
+			return false;
+		}
+		std::string value = argv[++i];
+		if (arg == "--sizes") {
+			opts.sizes.clear();
+			for (const auto& size : splitList(value))
+				opts.sizes.push_back(std::atoi(size.c_str()));
+		} else if (arg == "--kinds") {
+			opts.kinds = splitList(value);
+		} else if (arg == "--formats") {
+			opts.formats = splitList(value);
+		} else if (arg == "--modes") {
+			opts.modes = splitList(value);
+		} else if (arg == "--repeat") {
+			opts.repeat = std::max(1, std::atoi(value.c_str()));
+		} else {
+			printUsage();
+			return false;
+		}
+	}
+	return true;
+}
+
+}
+
+int main(int argc, char* argv[]) {
+	Options opts;
+	if (!parseOptions(argc, argv, opts))
+		return 1;
+	g_verbose = false;
+
+	std::printf("%-9s %5s %-9s %-8s %9s %9s %9s  %s\n",
+				"image", "size", "format", "mode", "ms", "MP/s", "peak MB", "hash");
+
+	uint64_t combined = fnv1a(nullptr, 0);
+	double totalSeconds = 0, totalPixels = 0, maxPeakMB = 0;
+	int cases = 0;
+	for (const auto& kind : imageKinds) {
+		if (!selected(opts.kinds, kind.name)) continue;
+		for (int size : opts.sizes) {
+			for (const auto& format : formats) {
+				if (!selected(opts.formats, format.name)) continue;
+				for (const char* mode : modes) {
+					if (!selected(opts.modes, mode)) continue;
+					int textureType = textureTypeFor(format.pixelFormat, mode);
+					if (textureType == -1) continue;
+
+					// Strided textures are made a bit narrower, so the width is
+					// not a power of two whenever that's possible
+					int width = size, height = size;
+					if (textureType & FLAG_STRIDED) {
+						width = std::max(32, (size * 3 / 4) / 32 * 32);
+						textureType |= width / 32;
+					}
+					if (!isValidSize(width, height, textureType)) continue;
+
+					CaseResult result;
+					double peakMB = 0;
+					auto work = [&](CaseResult& r) { return runCase(kind, width, height, size, textureType, opts.repeat, r); };
+					if (!runInChild(work, result, peakMB)) {
+						std::cerr << "Failed to run " << kind.name << " " << size << " " << format.name << " " << mode << "\n";
+						return 1;
+					}
+					combined = fnv1a(&result.hash, sizeof(result.hash), combined);
+
+					const double pixels = (double)width * height;
+					totalSeconds += result.seconds;
+					totalPixels += pixels;
+					maxPeakMB = std::max(maxPeakMB, peakMB);
+					cases++;
+					std::printf("%-9s %5d %-9s %-8s %9.2f %9.2f %9.1f  %016llx\n",
+								kind.name, size, format.name, mode, result.seconds * 1000,
+								pixels / 1e6 / std::max(result.seconds, 1e-9), peakMB, (unsigned long long)result.hash);
+					std::fflush(stdout);
+				}
+			}
+		}
+	}
+
+	std::printf("%d cases, %.2f s, %.2f MP/s overall, largest peak %.1f MB, combined hash %016llx\n",
+				cases, totalSeconds, totalPixels / 1e6 / std::max(totalSeconds, 1e-9), maxPeakMB,
+				(unsigned long long)combined);
+	return 0;
+}
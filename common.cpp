@@ -1,14 +1,21 @@
 #include "common.h"
 #include "imagecontainer.h"
+#include "indexedimage.h"
+#include "log.h"
+#include "palette.h"
 
 #include <cmath>
 #include <cassert>
-#include <iostream>
+#include <sstream>
 
 #define M_PI 3.1415926535897932384f
 #define HALF_PI M_PI/2.0f
 #define DOUBLE_PI M_PI*2.0f
 
+VQOptions g_vqOptions;
+PaletteOptions g_paletteOptions;
+bool g_fastPreview = false;
+
 static inline bool powerOfTwo(int x) {
 	return (x > 0 && (x & (x - 1)) == 0);
 }
@@ -50,7 +57,7 @@ bool isPaletted(int textureType) {
 }
 bool is16BPP(int textureType) { return !isPaletted(textureType); }
 
-static uint16_t toSpherical(const RGBA& c) {
+uint16_t toSpherical(const RGBA& c) {
 	
 	float vx = (c.r/255.0f) * 2.0f - 1.0f;
 	float vy = (c.g/255.0f) * 2.0f - 1.0f;
@@ -77,10 +84,10 @@ static RGBA toCartesian(uint16_t SR) {
 	float R = ((SR & 0xFF) / 255.0) * DOUBLE_PI;
 	if (R > M_PI) R -= DOUBLE_PI;
 	RGBA color;
-	color.r = (sin(S) * cos(R) + 1.0f) * 0.5f;
-	color.g = (sin(S) * sin(R) + 1.0f) * 0.5f;
-	color.b = (cos(S) + 1.0f) * 0.5f;
-	color.a = 1;
+	color.r = (uint8_t)((sin(S) * cos(R) + 1.0f) * 0.5f * 255);
+	color.g = (uint8_t)((sin(S) * sin(R) + 1.0f) * 0.5f * 255);
+	color.b = (uint8_t)(cos(S) * 255);	// toSpherical() maps blue to 0..1, not -1..1
+	color.a = 255;
 	return color;
 }
 
@@ -107,7 +114,7 @@ uint16_t to16BPP(const RGBA& argb, int pixelFormat) {
 	case PIXELFORMAT_BUMPMAP:
 		return toSpherical(argb);
 	default:
-		std::cerr << "Unsupported format " << pixelFormat << " in to16BPP\n";
+		logError("Unsupported format " + std::to_string(pixelFormat) + " in to16BPP");
 		return 0xFFFF;
 	}
 }
@@ -262,6 +269,24 @@ int writeTextureHeader(std::ostream& stream,int width,int height,int textureType
 	return size;
 }
 
+std::string encodeTexture(const ImageContainer& images, int textureType, Palette& palette) {
+	std::ostringstream out;
+	int expectedSize = writeTextureHeader(out, images.width(), images.height(), textureType);
+	std::streampos positionBeforeData = out.tellp();
+
+	if (isPaletted(textureType)) {
+		std::vector<IndexedImage> indexedImages;
+		reduceColors(images, isFormat(textureType, PIXELFORMAT_PAL4BPP) ? 16 : 256, palette, indexedImages);
+		writePalettedData(out, textureType, indexedImages, palette);
+	} else {
+		convert16BPP(out, images, textureType);
+	}
+
+	int padding = expectedSize - (int)(out.tellp() - positionBeforeData);
+	if (padding > 0) writeZeroes(out, padding);
+	return out.str();
+}
+
 uint32_t combineHash(const RGBA& rgba, uint32_t seed) {
 	uint32_t val = ((rgba.a<<24)|(rgba.r<<16)|(rgba.g<<8)|rgba.b);
 	seed ^= val + 0x9e3779b9 + (seed<<6) + (seed>>2);
@@ -3,6 +3,7 @@
 
 #include <cstdint>
 #include <ostream>
+#include <string>
 
 #include "vqtools.h" // contains some cruft
 
@@ -32,6 +33,13 @@
 #define TEXTURE_MAGIC   "DTEX"
 #define PALETTE_MAGIC   "DPAL"
 
+// Color formats of palette files. Palette files from before the format field
+// existed are always ARGB8888.
+#define PALETTE_FORMAT_ARGB8888 0
+#define PALETTE_FORMAT_ARGB1555 1
+#define PALETTE_FORMAT_RGB565   2
+#define PALETTE_FORMAT_ARGB4444 3
+
 #define MIPMAP_OFFSET_4BPP  1
 #define MIPMAP_OFFSET_8BPP  3
 #define MIPMAP_OFFSET_16BPP 6
@@ -49,19 +57,73 @@ bool is16BPP(int textureType);
 uint16_t to16BPP(const RGBA& px, int pixelFormat);
 RGBA to32BPP(uint16_t px, int pixelFormat);
 
+// A bumpmap normal, with x and y in -1..1 and z in 0..1, as the 8-bit
+// elevation and rotation angles of the BUMPMAP format
+uint16_t toSpherical(const RGBA& c);
+
 
 void RGBtoYUV422(const RGBA& rgb1, const RGBA& rgb2, uint16_t& yuv1, uint16_t& yuv2);
 void YUV422toRGB(const uint16_t yuv1, const uint16_t yuv2, RGBA& rgb1, RGBA& rgb2);
 
+// Size of the texture data in bytes, padded to a multiple of 32
+int calculateSize(int w, int h, int textureType);
 int writeTextureHeader(std::ostream& stream, int width, int height, int textureType);
 
 uint32_t combineHash(const RGBA& rgba, uint32_t seed);
 
+// Settings used by every VectorQuantizer the converters create.
+extern VQOptions g_vqOptions;
+
+// How paletted textures with too many colors get reduced.
+enum PaletteQuantizer {
+	PALETTE_QUANTIZER_VQ,		 // VectorQuantizer<4> over one vector per pixel
+	PALETTE_QUANTIZER_MEDIANCUT	 // Median cut over a color histogram
+};
+
+struct PaletteOptions {
+	PaletteQuantizer quantizer = PALETTE_QUANTIZER_VQ;
+	int kmeansPasses = 0;	// Polish passes after median cut
+	int format = PALETTE_FORMAT_ARGB8888;	// Color format of saved palette files
+};
+extern PaletteOptions g_paletteOptions;
+
+// Write PNG previews without compression. Other preview formats are picked
+// by the extension of the preview filename.
+extern bool g_fastPreview;
+
+// What to do with input images that are not a valid texture size.
+enum ResizeMode {
+	RESIZE_NONE,			// Reject them
+	RESIZE_FIT,				// Scale down to the largest valid size that fits
+	RESIZE_NEAREST_POW2		// Scale to the closest valid size
+};
+
 class ImageContainer;
+class Image;
+class IndexedImage;
+class Palette;
 
 void convert16BPP(std::ostream& stream, const ImageContainer& images, int textureType);
-void convertPaletted(std::ostream& stream, const ImageContainer& images, int textureType, const std::string& palFilename);
-bool generatePreview(const std::string& textureFilename, const std::string& paletteFilename, const std::string& previewFilename, const std::string& codeUsageFilename);
+// 'palette' receives the palette that was saved to palFilename
+void convertPaletted(std::ostream& stream, const ImageContainer& images, int textureType, const std::string& palFilename, Palette& palette);
+bool generatePreview(const std::string& textureFilename, const std::string& paletteFilename, const std::string& previewFilename, const std::string& codeUsageFilename, const Palette* palette = nullptr);
+
+// Same as above for a texture file (header included) that is in memory.
+// Paletted textures need the palette.
+bool generatePreview(const uint8_t* texture, size_t size, const Palette* palette, const std::string& previewFilename, const std::string& codeUsageFilename);
+
+// The two halves of convertPaletted, for callers that manage palettes themselves.
+void reduceColors(const ImageContainer& images, int maxColors, Palette& palette, std::vector<IndexedImage>& indexedImages);
+// Builds one palette of at most maxColors colors for several sets of images
+// together, rounded to the palette format. Index each set with mapToPalette.
+void reduceColors(const std::vector<const ImageContainer*>& imageSets, int maxColors, Palette& palette);
+// Indexes the images with the closest colors of the palette, smallest first.
+void mapToPalette(const ImageContainer& images, const Palette& palette, std::vector<IndexedImage>& indexedImages);
+void writePalettedData(std::ostream& stream, int textureType, const std::vector<IndexedImage>& indexedImages, const Palette& palette);
+
+// Converts the images into a whole texture file in memory, padding included.
+// Paletted textures get a palette of their own, nothing is saved.
+std::string encodeTexture(const ImageContainer& images, int textureType, Palette& palette);
 
 
 #endif 
\ No newline at end of file
@@ -3,9 +3,12 @@
 #include <unordered_map>
 #include <cstring>
 #include "imagecontainer.h"
+#include "indexedimage.h"
 #include "twiddler.h"
 #include "vqtools.h"
 #include "common.h"
+#include "stats.h"
+#include "log.h"
 
 
 void convertAndWriteTexel(std::ostream& stream, const RGBA& texel, int pixelFormat, bool twiddled);
@@ -14,6 +17,7 @@ void writeUncompressedData(std::ostream& stream, const ImageContainer& images, i
 void writeCompressedData(std::ostream& stream, const ImageContainer& images, int pixelFormat);
 
 void convert16BPP(std::ostream& stream, const ImageContainer& images, int textureType) {
+	TraceScope trace("convert16BPP", "convert");
 	const int pixelFormat = (textureType >> PIXELFORMAT_SHIFT) & PIXELFORMAT_MASK;
 
 	if (textureType & FLAG_STRIDED) {
@@ -56,12 +60,14 @@ void convertAndWriteTexel(std::ostream& stream, const RGBA& texel, int pixelForm
 }
 
 void writeStrideData(std::ostream& stream, const Image& img, int pixelFormat) {
+	StatsTimer timer(PHASE_TWIDDLE);
 	for (int y=0; y<img.height(); y++)
 		for (int x=0; x<img.width(); x++)
 			convertAndWriteTexel(stream, img.pixel(x, y), pixelFormat, false);
 }
 
 void writeUncompressedData(std::ostream& stream, const ImageContainer& images, int pixelFormat) {
+	StatsTimer timer(PHASE_TWIDDLE);
 	// Mipmap offset
 	if (images.hasMipmaps()) {
 		writeZeroes(stream, MIPMAP_OFFSET_16BPP);
@@ -119,7 +125,8 @@ uint64_t packQuad(RGBA topLeft, RGBA topRight, RGBA bottomLeft, RGBA bottomRight
 // It will keep counting blocks even if the block count exceeds maxCodes for the sole
 // purpose of reporting it back to the user.
 // Returns number of unique 2x2 16BPP pixel blocks in all images.
-int encodeLossless(const ImageContainer& images, int pixelFormat, std::vector<Image>& indexedImages, std::vector<uint64_t>& codebook, int maxCodes) {
+int encodeLossless(const ImageContainer& images, int pixelFormat, std::vector<IndexedImage>& indexedImages, std::vector<uint64_t>& codebook, int maxCodes) {
+	StatsTimer timer(PHASE_LOSSLESS);
 	std::unordered_map<uint64_t, int> uniqueQuads; // Quad <=> index
 
 	for (int i=0; i<images.imageCount(); i++) {
@@ -129,8 +136,7 @@ int encodeLossless(const ImageContainer& images, int pixelFormat, std::vector<Im
 		if (img.width() < MIN_MIPMAP_VQ || img.height() < MIN_MIPMAP_VQ)
 			continue;
 
-		Image indexedImage(img.width() / 2, img.height() / 2/*, Image::Format_Indexed8*/);
-		indexedImage.allocateIndexed(256);
+		IndexedImage indexedImage(img.width() / 2, img.height() / 2);
 
 		for (int y=0;y<img.height();y+=2) {
 			for (int x=0;x<img.width();x+=2) {
@@ -144,13 +150,13 @@ int encodeLossless(const ImageContainer& images, int pixelFormat, std::vector<Im
 					uniqueQuads[quad] = (int) uniqueQuads.size();
 
 				if ( (int) uniqueQuads.size() <= maxCodes )
-					indexedImage.setIndexedPixel( x/2, y/2, uniqueQuads[quad] );
+					indexedImage.setPixel( x/2, y/2, uniqueQuads[quad] );
 			}
 		}
 
 		// Only add the image if we haven't hit the code limit
 		if (uniqueQuads.size() <= maxCodes) {
-			indexedImages.push_back(indexedImage);
+			indexedImages.push_back(std::move(indexedImage));
 		}
 	}
 
@@ -228,92 +234,101 @@ static void vectorizeARGB(const ImageContainer& images, std::vector<Vec<16>>& ve
 	}
 }
 
-static void devectorizeRGB(const ImageContainer& srcImages, const std::vector<Vec<12>>& vectors, const VectorQuantizer<12>& vq, int pixelFormat, std::vector<Image>& indexedImages, std::vector<uint64_t>& codebook) {
+static void devectorizeRGB(const ImageContainer& srcImages, const std::vector<Vec<12>>& vectors, const VectorQuantizer<12>& vq, int pixelFormat, std::vector<IndexedImage>& indexedImages, std::vector<uint64_t>& codebook) {
+	StatsTimer timer(PHASE_INDEXING);
 	int vindex = 0;
 
 	for (int i=0; i<srcImages.imageCount(); i++) {
 		const auto& srcImage = srcImages.getByIndex(i);
 		if (srcImage.width() == 1 || srcImage.height() == 1)
 			continue;
-		Image img(srcImage.width()/2, srcImage.height()/2/*, Image::Format_Indexed8*/);
-		img.allocateIndexed(256);
+		IndexedImage img(srcImage.width()/2, srcImage.height()/2);
 		for (int y=0; y<img.height(); y++) {
+			uint8_t* row = img.row(y);
 			for (int x=0; x<img.width(); x++) {
 				const Vec<12>& vec = vectors[vindex];
-				int codeIndex = vq.findClosest(vec);
-				img.setIndexedPixel(x, y, codeIndex);
+				row[x] = (uint8_t)vq.findClosest(vec);
 				vindex++;
 			}
 		}
-		indexedImages.push_back(img);
+		indexedImages.push_back(std::move(img));
 	}
 
 	for (int i=0; i<vq.codeCount(); i++) {
+		// The vectors hold colors in 0..1, convert them back to 0..255
 		const Vec<12>& vec = vq.codeVector(i);
-		RGBA tl = {vec[0], vec[1], vec[2]};
-		RGBA tr = {vec[3], vec[4], vec[5]};
-		RGBA bl = {vec[6], vec[7], vec[8]};
-		RGBA br = {vec[9], vec[10], vec[11]};
-		uint64_t quad = packQuad(tl, tr, bl, br, pixelFormat);
+		uint32_t tl, tr, bl, br;
+		vec2rgb(vec, tl, 0);
+		vec2rgb(vec, tr, 3);
+		vec2rgb(vec, bl, 6);
+		vec2rgb(vec, br, 9);
+		uint64_t quad = packQuad(unpackColor(tl), unpackColor(tr), unpackColor(bl), unpackColor(br), pixelFormat);
 		codebook.push_back(quad);
 	}
 }
 
-static void devectorizeARGB(const ImageContainer& srcImages, const std::vector<Vec<16>>& vectors, const VectorQuantizer<16>& vq, int format, std::vector<Image>& indexedImages, std::vector<uint64_t>& codebook) {
+static void devectorizeARGB(const ImageContainer& srcImages, const std::vector<Vec<16>>& vectors, const VectorQuantizer<16>& vq, int format, std::vector<IndexedImage>& indexedImages, std::vector<uint64_t>& codebook) {
+	StatsTimer timer(PHASE_INDEXING);
 	int vindex = 0;
 
 	for (int i=0; i<srcImages.imageCount(); i++) {
 		const auto& srcImage = srcImages.getByIndex(i);
 		if (srcImage.width() == 1 || srcImage.height() == 1)
 			continue;
-		Image img(srcImage.width()/2, srcImage.height()/2/*, Image::Format_Indexed8*/);
-		img.allocateIndexed(256);
+		IndexedImage img(srcImage.width()/2, srcImage.height()/2);
 		for (int y=0; y<img.height(); y++) {
+			uint8_t* row = img.row(y);
 			for (int x=0; x<img.width(); x++) {
 				const Vec<16>& vec = vectors[vindex];
-				int codeIndex = vq.findClosest(vec);
-				img.setIndexedPixel(x, y, codeIndex);
+				row[x] = (uint8_t)vq.findClosest(vec);
 				vindex++;
 			}
 		}
-		indexedImages.push_back(img);
+		indexedImages.push_back(std::move(img));
 	}
 
 	for (int i=0; i<vq.codeCount(); i++) {
 		const Vec<16>& vec = vq.codeVector(i);
-		RGBA tl = {vec[1], vec[2], vec[3], vec[0]};
-		RGBA tr = {vec[5], vec[6], vec[7], vec[4]};
-		RGBA bl = {vec[9], vec[10], vec[11], vec[8]};
-		RGBA br = {vec[13], vec[14], vec[15], vec[12]};
-		uint64_t quad = packQuad(tl, tr, bl, br, format);
+		uint32_t tl, tr, bl, br;
+		vec2argb(vec, tl, 0);
+		vec2argb(vec, tr, 4);
+		vec2argb(vec, bl, 8);
+		vec2argb(vec, br, 12);
+		uint64_t quad = packQuad(unpackColor(tl), unpackColor(tr), unpackColor(bl), unpackColor(br), format);
 		codebook.push_back(quad);
 	}
 }
 
 void writeCompressedData(std::ostream& stream, const ImageContainer& images, int pixelFormat) {
-	std::vector<Image> indexedImages;
+	std::vector<IndexedImage> indexedImages;
 	std::vector<uint64_t> codebook;
 
 	const int numQuads = encodeLossless(images, pixelFormat, indexedImages, codebook, 256);
 
-	std::cout << "Source images contain" << numQuads << "unique quads";
+	logDebug("Source images contain " + std::to_string(numQuads) + " unique quads");
 
 	if (numQuads > 256) {
 		if ((pixelFormat != PIXELFORMAT_ARGB1555) && (pixelFormat != PIXELFORMAT_ARGB4444)) {
 			std::vector<Vec<12>> vectors;
 			VectorQuantizer<12> vq;
+			vq.options = g_vqOptions;
+			vq.message = logDebug;
 			vectorizeRGB(images, vectors);
 			vq.compress(vectors, 256);
 			devectorizeRGB(images, vectors, vq, pixelFormat, indexedImages, codebook);
 		} else {
 			std::vector<Vec<16>> vectors;
 			VectorQuantizer<16> vq;
+			vq.options = g_vqOptions;
+			vq.message = logDebug;
 			vectorizeARGB(images, vectors);
 			vq.compress(vectors, 256);
 			devectorizeARGB(images, vectors, vq, pixelFormat, indexedImages, codebook);
 		}
 	}
 
+	StatsTimer timer(PHASE_TWIDDLE);
+
 	// Build the codebook
 	uint16_t codes[256 * 4];
 	memset(codes, 0, 2048);
@@ -329,13 +344,28 @@ void writeCompressedData(std::ostream& stream, const ImageContainer& images, int
 	for (int i=0; i<1024; i++)
 		stream.write( (char*) &codes[i], 2 );
 
-	// Write the 1x1 mipmap level
-	if (images.imageCount() > 1)
-		writeZeroes(stream, 1);
+	// Write the 1x1 mipmap level. It is read from the last pixel of the
+	// code this index points to, so point it at the code that matches best.
+	if (images.imageCount() > 1) {
+		const int format = (pixelFormat == PIXELFORMAT_YUV422) ? PIXELFORMAT_RGB565 : pixelFormat;
+		const RGBA target = images.getBySize(1).pixel(0, 0);
+		uint8_t best = 0;
+		int bestDistance = INT32_MAX;
+		for (int i=0; i<(int)codebook.size(); i++) {
+			RGBA c = to32BPP(codes[i * 4 + 3], format);
+			int dr = c.r - target.r, dg = c.g - target.g, db = c.b - target.b, da = c.a - target.a;
+			int distance = dr*dr + dg*dg + db*db + ((format == PIXELFORMAT_RGB565) ? 0 : da*da);
+			if (distance < bestDistance) {
+				bestDistance = distance;
+				best = (uint8_t)i;
+			}
+		}
+		stream.write((char*)&best, 1);
+	}
 
 	// Write all mipmap levels
 	for (int i=0; i<indexedImages.size(); i++) {
-		const Image& img = indexedImages[i];
+		const IndexedImage& img = indexedImages[i];
 		const Twiddler twiddler(img.width(), img.height());
 		const int pixels = img.width() * img.height();
 
@@ -343,7 +373,7 @@ void writeCompressedData(std::ostream& stream, const ImageContainer& images, int
 			const int index = twiddler.index(j);
 			const int x = index % img.width();
 			const int y = index / img.width();
-			uint8_t val = img.indexedPixelAt(x, y);
+			uint8_t val = img.pixel(x, y);
 			stream.write( (char*) &val, 1 );
 		}
 	}
@@ -1,12 +1,18 @@
 #include "imagecontainer.h"
+#include "indexedimage.h"
 #include "twiddler.h"
 #include "palette.h"
 #include "vqtools.h"
+#include "mediancut.h"
 #include "common.h"
+#include "stats.h"
+#include "log.h"
 
 #include <iostream>
 #include <vector>
 #include <cstring>
+#include <cstdint>
+#include <unordered_map>
 
 static void vectorizeARGB(const ImageContainer& images, std::vector<Vec<4>>& vectors) {
 	for ( int i = 0; i < images.imageCount(); i++ ) {
@@ -25,37 +31,80 @@ static void vectorizeARGB(const ImageContainer& images, std::vector<Vec<4>>& vec
 	}
 }
 
-static void devectorizeARGB(const ImageContainer& srcImages, const std::vector<Vec<4>>& vectors, const VectorQuantizer<4>& vq, std::vector<Image>& indexedImages, Palette& palette) {
+static void addCodeColors(const VectorQuantizer<4>& vq, Palette& palette) {
+	for ( int i = 0; i < vq.codeCount(); i++ ) {
+		const Vec<4>& v = vq.codeVector(i);
+		uint32_t color = (uint8_t)( v[0]*255)<<24 | (uint8_t)(v[1]*255)<<16 |
+					    (uint8_t)( v[2]*255)<<8 | (uint8_t)(v[3]*255);
+		palette.insert(color);
+	}
+}
+
+static void devectorizeARGB(const ImageContainer& srcImages, const std::vector<Vec<4>>& vectors, const VectorQuantizer<4>& vq, std::vector<IndexedImage>& indexedImages, Palette& palette) {
+	StatsTimer timer(PHASE_INDEXING);
 	int vindex = 0;
 	for ( int i = 0; i < srcImages.imageCount(); i++ ) {
 		const Image& src = srcImages.getByIndex(i);
-		Image dst( src.width(), src.height() );
-		dst.allocateIndexed(256);
+		IndexedImage dst( src.width(), src.height() );
 
 		for ( int y = 0; y < src.height(); y++ ) {
+			uint8_t* row = dst.row(y);
 			for ( int x = 0; x < src.width(); x++ ) {
 				const Vec<4>& vec = vectors[vindex++];
-				int codeIndex = vq.findClosest(vec);
-				dst.setIndexedPixel( x, y, (uint8_t) codeIndex );
+				row[x] = (uint8_t) vq.findClosest(vec);
 			}
 		}
-		indexedImages.push_back(dst);
+		indexedImages.push_back(std::move(dst));
 	}
 	
-	for ( int i = 0; i < vq.codeCount(); i++ ) {
-		const Vec<4>& v = vq.codeVector(i);
-		uint32_t color = (uint8_t)( v[0]*255)<<24 | (uint8_t)(v[1]*255)<<16 |
-					    (uint8_t)( v[2]*255)<<8 | (uint8_t)(v[3]*255);
-		palette.insert(color);
+	addCodeColors(vq, palette);
+}
+
+// Maps every pixel to the closest palette color, smallest level first. Each
+// distinct color is only looked up once.
+void mapToPalette(const ImageContainer& images, const Palette& palette, std::vector<IndexedImage>& indexedImages) {
+	StatsTimer timer(PHASE_INDEXING);
+	std::vector<RGBA> colors(palette.colorCount());
+	for (int i = 0; i < palette.colorCount(); i++)
+		colors[i] = unpackColor(palette.colorAt(i));
+
+	std::unordered_map<uint32_t, uint8_t> closest;
+	indexedImages.clear();
+	for ( int i = 0; i < images.imageCount(); i++ ) {
+		const Image& src = images.getByIndex(i);
+		IndexedImage dst( src.width(), src.height() );
+		const RGBA* px = src.data();
+
+		for ( int y = 0; y < src.height(); y++ ) {
+			uint8_t* row = dst.row(y);
+			for ( int x = 0; x < src.width(); x++, px++ ) {
+				const uint32_t argb = packColor(*px);
+				auto it = closest.find(argb);
+				if (it == closest.end()) {
+					int best = 0, bestDistance = INT32_MAX;
+					for (int c = 0; c < (int)colors.size(); c++) {
+						const int da = px->a - colors[c].a, dr = px->r - colors[c].r;
+						const int dg = px->g - colors[c].g, db = px->b - colors[c].b;
+						const int distance = da*da + dr*dr + dg*dg + db*db;
+						if (distance < bestDistance) {
+							bestDistance = distance;
+							best = c;
+						}
+					}
+					it = closest.emplace(argb, (uint8_t)best).first;
+				}
+				row[x] = it->second;
+			}
+		}
+		indexedImages.push_back(std::move(dst));
 	}
 }
 
-void convertToIndexedImages(const ImageContainer& src, const Palette& pal, std::vector<Image>& dst);
-void writeUncompressed4BPPData(std::ostream& stream, const std::vector<Image>& indexedImages);
-void writeUncompressed8BPPData(std::ostream& stream, const std::vector<Image>& indexedImages);
-void writeUncompressedPreview(const std::string& filename, const std::vector<Image>& indexedImages, const Palette& palette);
-void writeCompressed4BPPData(std::ostream& stream, const std::vector<Image>& indexedImages, const Palette& palette);
-void writeCompressed8BPPData(std::ostream& stream, const std::vector<Image>& indexedImages, const Palette& palette);
+void writeUncompressed4BPPData(std::ostream& stream, const std::vector<IndexedImage>& indexedImages);
+void writeUncompressed8BPPData(std::ostream& stream, const std::vector<IndexedImage>& indexedImages);
+void writeUncompressedPreview(const std::string& filename, const std::vector<IndexedImage>& indexedImages, const Palette& palette);
+void writeCompressed4BPPData(std::ostream& stream, const std::vector<IndexedImage>& indexedImages, const Palette& palette);
+void writeCompressed8BPPData(std::ostream& stream, const std::vector<IndexedImage>& indexedImages, const Palette& palette);
 
 /*
  * This conversion basically has three modes:
@@ -72,33 +121,89 @@ void writeCompressed8BPPData(std::ostream& stream, const std::vector<Image>& ind
  *    Then, using the reduced images as input, perform vector quantization
  *    with a vector dimension of 32 or 64 (2x4 or 4x4 pixel blocks).
  */
-void convertPaletted(std::ostream& stream, const ImageContainer& images, int textureType, const std::string& paletteFilename) {
+void convertPaletted(std::ostream& stream, const ImageContainer& images, int textureType, const std::string& paletteFilename, Palette& palette) {
 	const int maxColors = isFormat(textureType, PIXELFORMAT_PAL4BPP) ? 16 : 256;
-	Palette palette(images);
-	std::vector<Image> indexedImages;
+	std::vector<IndexedImage> indexedImages;
+
+	reduceColors(images, maxColors, palette, indexedImages);
 
-	//qDebug("Palette contains %d colors", palette.colorCount());
+	// The palette is finished now, so save it.
+	palette.save(paletteFilename, g_paletteOptions.format);
+
+	writePalettedData(stream, textureType, indexedImages, palette);
+}
 
-	if (palette.colorCount() > maxColors) {
-		// The palette has too many colors, so perform a vector quantization to reduce
-		// the color count down to what we need.
-		//qDebug("Reducing palette to %d colors", maxColors);
+// Builds a palette of at most maxColors colors for the images, and indexed
+// images (smallest first) that refer to it.
+void reduceColors(const ImageContainer& images, int maxColors, Palette& palette, std::vector<IndexedImage>& indexedImages) {
+	TraceScope trace("reduceColors", "convert");
+	// Counting the colors stops as soon as there are too many, otherwise the
+	// indexed images come out of the same pass.
+	if (!palette.census(images, maxColors, &indexedImages)) {
 		palette.clear();
-		VectorQuantizer<4> vq;
-		std::vector<Vec<4>> vectors;
-		vectorizeARGB(images, vectors);
-		vq.compress(vectors, maxColors);
-		devectorizeARGB(images, vectors, vq, indexedImages, palette);
-	} else {
-		// Convert the input images to indexed images so we can use the same output code
-		// as the reduced color images.
-		convertToIndexedImages(images, palette, indexedImages);
+		indexedImages.clear();
+
+		if (g_paletteOptions.quantizer == PALETTE_QUANTIZER_MEDIANCUT) {
+			// The palette has too many colors, so cut up the color histogram
+			// into as many boxes as we need colors.
+			medianCut(images, maxColors, g_paletteOptions.kmeansPasses, palette, indexedImages);
+		} else {
+			// The palette has too many colors, so perform a vector quantization to reduce
+			// the color count down to what we need.
+			//qDebug("Reducing palette to %d colors", maxColors);
+			VectorQuantizer<4> vq;
+			vq.options = g_vqOptions;
+			vq.message = logDebug;
+			std::vector<Vec<4>> vectors;
+			vectorizeARGB(images, vectors);
+			vq.compress(vectors, maxColors);
+			devectorizeARGB(images, vectors, vq, indexedImages, palette);
+		}
 	}
 
-	// The palette is finished now, so save it.
-	palette.save(paletteFilename);
+	// A palette saved with 16-bit colors is rounded first, and the pixels are
+	// mapped to the rounded colors. Otherwise the texture would be made, and
+	// previewed and measured, with colors the saved palette doesn't have.
+	if (g_paletteOptions.format != PALETTE_FORMAT_ARGB8888) {
+		palette.quantize(g_paletteOptions.format);
+		mapToPalette(images, palette, indexedImages);
+	}
+}
+
+void reduceColors(const std::vector<const ImageContainer*>& imageSets, int maxColors, Palette& palette) {
+	TraceScope trace("reduceColors", "convert");
+	palette.clear();
+	bool fits = true;
+	for (const ImageContainer* images : imageSets) {
+		Palette colors;
+		fits = colors.census(*images, maxColors);
+		for (int i = 0; fits && i < colors.colorCount(); i++)
+			palette.insert(colors.colorAt(i));
+		fits = fits && palette.colorCount() <= maxColors;
+		if (!fits) break;
+	}
 
-	// Write data
+	if (!fits) {
+		palette.clear();
+		if (g_paletteOptions.quantizer == PALETTE_QUANTIZER_MEDIANCUT) {
+			medianCut(imageSets, maxColors, g_paletteOptions.kmeansPasses, palette);
+		} else {
+			VectorQuantizer<4> vq;
+			vq.options = g_vqOptions;
+			vq.message = logDebug;
+			std::vector<Vec<4>> vectors;
+			for (const ImageContainer* images : imageSets)
+				vectorizeARGB(*images, vectors);
+			vq.compress(vectors, maxColors);
+			addCodeColors(vq, palette);
+		}
+	}
+
+	palette.quantize(g_paletteOptions.format);
+}
+
+void writePalettedData(std::ostream& stream, int textureType, const std::vector<IndexedImage>& indexedImages, const Palette& palette) {
+	TraceScope trace("writePalettedData", "convert");
 	if (textureType & FLAG_COMPRESSED) {
 		if (isFormat(textureType, PIXELFORMAT_PAL4BPP))
 			writeCompressed4BPPData(stream, indexedImages, palette);
@@ -113,36 +218,21 @@ void convertPaletted(std::ostream& stream, const ImageContainer& images, int tex
 }
 
 
-// Converts the src images to indexed images.
-// The indexed images are sorted from smallest to largest.
-void convertToIndexedImages(const ImageContainer& src, const Palette& pal, std::vector<Image>& dst) {
-	for (int i=0; i<src.imageCount(); i++) {
-		const Image& img = src.getByIndex(i);
-		Image dstImg(img.width(), img.height()/*, Image::Format_ARGB32*/);
-		for (int y=0; y<img.height(); y++)
-			for (int x=0; x<img.width(); x++) {
-				RGBA px = img.pixel(x,y);
-				uint32_t argb = packColor(px);
-				uint8_t index = (uint8_t) pal.indexOf(argb);
-				dstImg.setIndexedPixel( x, y, index );
-			}
-		dst.push_back(dstImg);
-	}
-}
+void writeUncompressed4BPPData(std::ostream& stream, const std::vector<IndexedImage>& indexedImages) {
+	StatsTimer timer(PHASE_TWIDDLE);
 
-void writeUncompressed4BPPData(std::ostream& stream, const std::vector<Image>& indexedImages) {
 	// Write mipmap offset if necessary
 	if (indexedImages.size() > 1)
 		writeZeroes(stream, MIPMAP_OFFSET_4BPP);
 
 	// Write all mipmaps from smallest to largest
 	for (int i=0; i<indexedImages.size(); i++) {
-		const Image& img = indexedImages[i];
+		const IndexedImage& img = indexedImages[i];
 
 		// Special case. There's only one pixel in the 1x1 mipmap level,
 		// but it's stored by itself in one byte.
 		if (img.width() == 1) {
-			uint8_t val = img.indexedPixelAt(0,0);
+			uint8_t val = img.pixel(0,0);
 			stream.write( (char*) &val, 1 );
 			continue;
 		}
@@ -160,7 +250,7 @@ void writeUncompressed4BPPData(std::ostream& stream, const std::vector<Image>& i
 				const int index = twiddler.index(j + k);
 				const int x = index % img.width();
 				const int y = index / img.width();
-				palindex[k] = (uint8_t) img.indexedPixelAt(x, y);
+				palindex[k] = (uint8_t) img.pixel(x, y);
 			}
 
 			uint8_t packed = (((palindex[1] & 0xF) << 4) | (palindex[0] & 0xF));
@@ -169,14 +259,16 @@ void writeUncompressed4BPPData(std::ostream& stream, const std::vector<Image>& i
 	}
 }
 
-void writeUncompressed8BPPData(std::ostream& stream, const std::vector<Image>& indexedImages) {
+void writeUncompressed8BPPData(std::ostream& stream, const std::vector<IndexedImage>& indexedImages) {
+	StatsTimer timer(PHASE_TWIDDLE);
+
 	// Write mipmap offset if necessary
 	if (indexedImages.size() > 1)
 		writeZeroes(stream, MIPMAP_OFFSET_8BPP);
 
 	// Write all mipmaps from smallest to largest
 	for (int i=0; i<indexedImages.size(); i++) {
-		const Image& img = indexedImages[i];
+		const IndexedImage& img = indexedImages[i];
 
 		Twiddler twiddler(img.width(), img.height());
 		const int pixels = img.width() * img.height();
@@ -185,7 +277,7 @@ void writeUncompressed8BPPData(std::ostream& stream, const std::vector<Image>& i
 			const int index = twiddler.index(j);
 			const int x = index % img.width();
 			const int y = index / img.width();
-			uint8_t value = img.indexedPixelAt(x, y);
+			uint8_t value = img.pixel(x, y);
 			stream.write( (char*) &value, 1 );
 		}
 	}
@@ -198,7 +290,7 @@ void writeUncompressed8BPPData(std::ostream& stream, const std::vector<Image>& i
 #define STORE_RIGHT	2	// Store the block in the right half of a 64D vector
 
 template<uint N>
-static void grab2x4Block(const Image& img, const Palette& pal, const int x, const int y, Vec<N>& vec, const uint storeMethod) {
+static void grab2x4Block(const IndexedImage& img, const Palette& pal, const int x, const int y, Vec<N>& vec, const uint storeMethod) {
 	static const int indexLUT[3][8] = {
 		{ 0,  4,  8, 12, 16, 20, 24, 28 }, // Full 32D vector
 		{ 0,  4, 16, 20, 32, 36, 48, 52 }, // Left half of 64D vector
@@ -210,7 +302,7 @@ static void grab2x4Block(const Image& img, const Palette& pal, const int x, cons
 
 	for (int yy=y; yy<(y+4); yy++) {
 		for (int xx=x; xx<(x+2); xx++) {
-			uint32_t pixel = pal.colorAt(img.indexedPixelAt(xx, yy));
+			uint32_t pixel = pal.colorAt(img.pixel(xx, yy));
 			argb2vec(pixel, vec, indexLUT[storeMethod][index]);
 			RGBA color = unpackColor( pixel );
 			hash = combineHash(color, hash);
@@ -242,8 +334,10 @@ static uint8_t findClosest(const std::vector<Vec<4>>& vectors, const Vec<4>& vec
 	return closestIndex;
 }
 
-void writeCompressed4BPPData(std::ostream& stream, const std::vector<Image>& indexedImages, const Palette& palette) {
+void writeCompressed4BPPData(std::ostream& stream, const std::vector<IndexedImage>& indexedImages, const Palette& palette) {
 	VectorQuantizer<64> vq;
+	vq.options = g_vqOptions;
+	vq.message = logDebug;
 	std::vector<Vec<64>> vectors;
 
 	// Vectorize the input images.
@@ -258,7 +352,7 @@ void writeCompressed4BPPData(std::ostream& stream, const std::vector<Image>& ind
 		Vec<64> vec(0);
 
 		for (int i=0; i<indexedImages.size(); i++) {
-			const Image& img = indexedImages[i];
+			const IndexedImage& img = indexedImages[i];
 
 			// Ignore images smaller than this
 			if (img.width() < MIN_MIPMAP_PALVQ || img.height() < MIN_MIPMAP_PALVQ)
@@ -309,7 +403,7 @@ void writeCompressed4BPPData(std::ostream& stream, const std::vector<Image>& ind
 		// is simple. Twiddle the data here though, since the mipmapped
 		// vectors need to be twiddled, so the same code can be used to
 		// devectorize this as well as mipmapped stuff.
-		const Image& img = indexedImages[0];
+		const IndexedImage& img = indexedImages[0];
 		const int imgw = img.width();
 		const int imgh = img.height();
 		const int blocks = (imgw * imgh) / 16;
@@ -329,6 +423,10 @@ void writeCompressed4BPPData(std::ostream& stream, const std::vector<Image>& ind
 
 	vq.compress(vectors, 256);
 
+	// The rest maps the codes back to palette indices and every block to
+	// its code.
+	StatsTimer timer(PHASE_INDEXING);
+
 	// The palette needs to be in a vector format for the next part,
 	// since we need to be able to perform searches in it.
 	std::vector<Vec<4>> vectorizedPalette;
@@ -381,8 +479,10 @@ void writeCompressed4BPPData(std::ostream& stream, const std::vector<Image>& ind
 
 
 
-void writeCompressed8BPPData(std::ostream& stream, const std::vector<Image>& indexedImages, const Palette& palette) {
+void writeCompressed8BPPData(std::ostream& stream, const std::vector<IndexedImage>& indexedImages, const Palette& palette) {
 	VectorQuantizer<32> vq;
+	vq.options = g_vqOptions;
+	vq.message = logDebug;
 	std::vector<Vec<32>> vectors;
 
 	// Vectorize the input images.
@@ -390,7 +490,7 @@ void writeCompressed8BPPData(std::ostream& stream, const std::vector<Image>& ind
 	// Grab the data as twiddled, it's simpler than twiddling it
 	// when we write it to file.
 	for (int i=0; i<indexedImages.size(); i++) {
-		const Image& img = indexedImages[i];
+		const IndexedImage& img = indexedImages[i];
 
 		// Ignore images smaller than this
 		if (img.width() < MIN_MIPMAP_PALVQ || img.height() < MIN_MIPMAP_PALVQ)
@@ -417,6 +517,10 @@ void writeCompressed8BPPData(std::ostream& stream, const std::vector<Image>& ind
 
 	vq.compress(vectors, 256);
 
+	// The rest maps the codes back to palette indices and every block to
+	// its code.
+	StatsTimer timer(PHASE_INDEXING);
+
 	// The palette needs to be in a vector format for the next part,
 	// since we need to be able to perform searches in it.
 	std::vector<Vec<4>> vectorizedPalette;
@@ -0,0 +1,242 @@
+#include "decoder.h"
+#include "palette.h"
+#include "common.h"
+#include "log.h"
+
+#include <cstring>
+#include <mutex>
+
+// Colors used to tell codebook entries apart in code usage images
+static const uint32_t colorCodes[256] = {
+	0xffffffff, 0xe3aaaa, 0xffc7c7, 0xaac7c7, 0xaac7aa, 0xaaaae3, 0xaaaaff, 0xaae3ff,
+	0xffffaae3, 0xe3ffaa, 0xffffaa, 0xffaaff, 0xaaffc7, 0xe3c7ff, 0xc7aaaa, 0xe3e3e3,
+	0xffaa7171, 0xc78e8e, 0x718e8e, 0x718e71, 0x7171aa, 0x7171c7, 0x71aac7, 0xc771aa,
+	0xffaac771, 0xc7c771, 0xc771c7, 0x71c78e, 0xaa8ec7, 0x8e7171, 0xaaaaaa, 0xc7c7c7,
+	0xff710000, 0x8e1c1c, 0x381c1c, 0x381c00, 0x380038, 0x380055, 0x383855, 0x8e0038,
+	0xff715500, 0x8e5500, 0x8e0055, 0x38551c, 0x711c55, 0x550000, 0x713838, 0x8e5555,
+	0xffaa38aa, 0xc755c7, 0x7155c7, 0x7155aa, 0x7138e3, 0x7138ff, 0x7171ff, 0xc738e3,
+	0xffaa8eaa, 0xc78eaa, 0xc738ff, 0x718ec7, 0xaa55ff, 0x8e38aa, 0xaa71e3, 0xc78eff,
+	0xff38aa38, 0x55c755, 0x00c755, 0x00c738, 0x00aa71, 0x00aa8e, 0x00e38e, 0x55aa71,
+	0xff38ff38, 0x55ff38, 0x55aa8e, 0x00ff55, 0x38c78e, 0x1caa38, 0x38e371, 0x55ff8e,
+	0xffe300aa, 0xff1cc7, 0xaa1cc7, 0xaa1caa, 0xaa00e3, 0xaa00ff, 0xaa38ff, 0xff00e3,
+	0xffe355aa, 0xff55aa, 0xff00ff, 0xaa55c7, 0xe31cff, 0xc700aa, 0xe338e3, 0xff55ff,
+	0xffe3aa00, 0xffc71c, 0xaac71c, 0xaac700, 0xaaaa38, 0xaaaa55, 0xaae355, 0xffaa38,
+	0xffe3ff00, 0xffff00, 0xffaa55, 0xaaff1c, 0xe3c755, 0xc7aa00, 0xe3e338, 0xffff55,
+	0xffaaaa00, 0xc7c71c, 0x71c71c, 0x71c700, 0x71aa38, 0x71aa55, 0x71e355, 0xc7aa38,
+	0xffaaff00, 0xc7ff00, 0xc7aa55, 0x71ff1c, 0xaac755, 0x8eaa00, 0xaae338, 0xc7ff55,
+	0xffe30071, 0xff1c8e, 0xaa1c8e, 0xaa1c71, 0xaa00aa, 0xaa00c7, 0xaa38c7, 0xff00aa,
+	0xffe35571, 0xff5571, 0xff00c7, 0xaa558e, 0xe31cc7, 0xc70071, 0xe338aa, 0xff55c7,
+	0xff3871aa, 0x558ec7, 0x008ec7, 0x008eaa, 0x0071e3, 0x0071ff, 0x00aaff, 0x5571e3,
+	0xff38c7aa, 0x55c7aa, 0x5571ff, 0x00c7c7, 0x388eff, 0x1c71aa, 0x38aae3, 0x55c7ff,
+	0xff3800aa, 0x551cc7, 0x001cc7, 0x001caa, 0x0000e3, 0x0000ff, 0x0038ff, 0x5500e3,
+	0xff3855aa, 0x5555aa, 0x5500ff, 0x0055c7, 0x381cff, 0x1c00aa, 0x3838e3, 0x5555ff,
+	0xff380071, 0x551c8e, 0x001c8e, 0x001c71, 0x0000aa, 0x0000c7, 0x0038c7, 0x5500aa,
+	0xff385571, 0x555571, 0x5500c7, 0x00558e, 0x381cc7, 0x1c0071, 0x3838aa, 0x5555c7,
+	0xff383800, 0x55551c, 0x00551c, 0x005500, 0x003838, 0x003855, 0x007155, 0x553838,
+	0xff388e00, 0x558e00, 0x553855, 0x008e1c, 0x385555, 0x1c3800, 0x387138, 0x558e55,
+	0xff383838, 0x555555, 0x005555, 0x005538, 0x003871, 0x00388e, 0x00718e, 0x553871,
+	0xff388e38, 0x558e38, 0x55388e, 0x008e55, 0x38558e, 0x1c3838, 0x387171, 0x558e8e,
+	0xffe33838, 0xff5555, 0xaa5555, 0xaa5538, 0xaa3871, 0xaa388e, 0xaa718e, 0xff3871,
+	0xffe38e38, 0xff8e38, 0xff388e, 0xaa8e55, 0xe3558e, 0xc73838, 0xe37171, 0xff8e8e,
+	0xffaa0000, 0xc71c1c, 0x711c1c, 0x711c00, 0x710038, 0x710055, 0x713855, 0xc70038,
+	0xffaa5500, 0xc75500, 0xc70055, 0x71551c, 0xaa1c55, 0x8e0000, 0xaa3838, 0xc75555
+};
+
+// Lookup table from a 16-bit texel to RGBA for one of the plain 16-bit pixel
+// formats, built the first time it's needed
+static const RGBA* texelTable(int pixelFormat) {
+	static std::vector<RGBA> tables[PIXELFORMAT_MASK + 1];
+	static std::once_flag built[PIXELFORMAT_MASK + 1];
+	std::call_once(built[pixelFormat], [pixelFormat]() {
+		tables[pixelFormat].resize(65536);
+		for (int i=0; i<65536; i++)
+			tables[pixelFormat][i] = to32BPP((uint16_t)i, pixelFormat);
+	});
+	return tables[pixelFormat].data();
+}
+
+// Spreads the bits of v out to the even bit positions
+static uint32_t spreadBits(uint32_t v) {
+	v = (v | (v << 8)) & 0x00FF00FF;
+	v = (v | (v << 4)) & 0x0F0F0F0F;
+	v = (v | (v << 2)) & 0x33333333;
+	v = (v | (v << 1)) & 0x55555555;
+	return v;
+}
+
+// Position of every pixel of a level in the texture data, split into a part
+// that depends on x and one that depends on y. Twiddled levels interleave the
+// bits of x and y with y in the lowest bit. Rectangular levels are a row or
+// column of square twiddled blocks the size of the smaller side.
+struct PixelOrder {
+	std::vector<uint32_t> xs, ys;
+
+	PixelOrder(int w, int h, bool twiddled) : xs(w), ys(h) {
+		if (!twiddled) {
+			for (int x=0; x<w; x++) xs[x] = x;
+			for (int y=0; y<h; y++) ys[y] = y * w;
+			return;
+		}
+		const int block = std::min(w, h);
+		for (int x=0; x<w; x++)
+			xs[x] = (w > h ? (x / block) * block * block : 0) + (spreadBits(x % block) << 1);
+		for (int y=0; y<h; y++)
+			ys[y] = (h > w ? (y / block) * block * block : 0) + spreadBits(y % block);
+	}
+};
+
+static inline uint16_t read16(const uint8_t* p) {
+	return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+bool readTextureHeader(const uint8_t* texture, size_t size, TextureHeader& header) {
+	if (size < 16 || std::memcmp(texture, TEXTURE_MAGIC, 4) != 0) {
+		logError("Not a texture file");
+		return false;
+	}
+
+	int16_t width, height;
+	int32_t textureType, dataSize;
+	std::memcpy(&width, texture + 4, 2);
+	std::memcpy(&height, texture + 6, 2);
+	std::memcpy(&textureType, texture + 8, 4);
+	std::memcpy(&dataSize, texture + 12, 4);
+
+	if (dataSize < 0 || size - 16 < (size_t)dataSize) {
+		logError("Texture data is truncated");
+		return false;
+	}
+
+	header.width = (textureType & FLAG_STRIDED) ? (textureType & 31) * 32 : width;
+	header.height = height;
+	header.textureType = textureType;
+	header.dataSize = dataSize;
+	return true;
+}
+
+bool decodeTexture(const uint8_t* texture, size_t size, const Palette* palette,
+				   std::vector<Image>& levels, std::vector<Image>* codeUsage) {
+	TextureHeader header;
+	if (!readTextureHeader(texture, size, header))
+		return false;
+
+	const int textureType = header.textureType;
+	const int pixelFormat = (textureType >> PIXELFORMAT_SHIFT) & PIXELFORMAT_MASK;
+	const bool mipmapped = (textureType & FLAG_MIPMAPPED);
+	const bool compressed = (textureType & FLAG_COMPRESSED);
+	const bool twiddled = !(textureType & (FLAG_STRIDED | FLAG_NONTWIDDLED));
+	const bool pal4 = isFormat(textureType, PIXELFORMAT_PAL4BPP);
+	const bool pal8 = isFormat(textureType, PIXELFORMAT_PAL8BPP);
+
+	if ((pal4 || pal8) && !palette) {
+		logError("Paletted textures can't be decoded without their palette");
+		return false;
+	}
+	if (header.width <= 0 || header.height <= 0 || (mipmapped && header.width != header.height)) {
+		logError("Invalid texture size");
+		return false;
+	}
+
+	const uint8_t* data = texture + 16;
+	size_t dataSize = header.dataSize;
+
+	// Compressed textures turn into their uncompressed layout by replacing
+	// every index with its 8 byte codebook entry.
+	std::vector<uint8_t> expanded;
+	const uint8_t* indices = nullptr;
+	if (compressed) {
+		if (dataSize < 2048) {
+			logError("Texture data is truncated");
+			return false;
+		}
+		indices = data + 2048;
+		const size_t count = dataSize - 2048;
+		expanded.resize(count * 8);
+		for (size_t i=0; i<count; i++)
+			std::memcpy(&expanded[i * 8], data + indices[i] * 8, 8);
+		data = expanded.data();
+		dataSize = expanded.size();
+	}
+
+	size_t offset = 0;
+	if (mipmapped)
+		offset = pal4 ? MIPMAP_OFFSET_4BPP : pal8 ? MIPMAP_OFFSET_8BPP : MIPMAP_OFFSET_16BPP;
+
+	RGBA paletteColors[256];
+	if (palette)
+		for (int i=0; i<256; i++)
+			paletteColors[i] = unpackColor(palette->colorAt(i));
+
+	levels.clear();
+	if (codeUsage) codeUsage->clear();
+
+	for (int size = mipmapped ? 1 : 0; ; size *= 2) {
+		const int w = mipmapped ? size : header.width;
+		const int h = mipmapped ? size : header.height;
+		const size_t pixels = (size_t)w * h;
+		const size_t bytes = pal4 ? std::max<size_t>(1, pixels / 2) : pal8 ? pixels : pixels * 2;
+		if (offset + bytes > dataSize) {
+			logError("Texture data is truncated");
+			return false;
+		}
+
+		const uint8_t* src = data + offset;
+		const PixelOrder order(w, h, twiddled);
+		Image img(w, h);
+
+		if (pal4) {
+			for (int y=0; y<h; y++) {
+				RGBA* row = img.data() + y * w;
+				for (int x=0; x<w; x++) {
+					const uint32_t p = order.ys[y] + order.xs[x];
+					row[x] = paletteColors[(src[p >> 1] >> ((p & 1) * 4)) & 0xF];
+				}
+			}
+		} else if (pal8) {
+			for (int y=0; y<h; y++) {
+				RGBA* row = img.data() + y * w;
+				for (int x=0; x<w; x++)
+					row[x] = paletteColors[src[order.ys[y] + order.xs[x]]];
+			}
+		} else if (pixelFormat == PIXELFORMAT_YUV422 && pixels > 1) {
+			// Horizontal pairs of pixels share their color
+			for (int y=0; y<h; y++) {
+				RGBA* row = img.data() + y * w;
+				for (int x=0; x+1<w; x+=2) {
+					const uint16_t yuv0 = read16(src + (order.ys[y] + order.xs[x]) * 2);
+					const uint16_t yuv1 = read16(src + (order.ys[y] + order.xs[x+1]) * 2);
+					YUV422toRGB(yuv0, yuv1, row[x], row[x+1]);
+				}
+			}
+		} else {
+			// A 1x1 YUV422 level is stored as RGB565
+			const RGBA* lut = texelTable(pixelFormat == PIXELFORMAT_YUV422 ? PIXELFORMAT_RGB565 : pixelFormat);
+			for (int y=0; y<h; y++) {
+				RGBA* row = img.data() + y * w;
+				for (int x=0; x<w; x++)
+					row[x] = lut[read16(src + (order.ys[y] + order.xs[x]) * 2)];
+			}
+		}
+
+		if (compressed && codeUsage) {
+			// Every index covers 8 bytes of the uncompressed layout
+			Image usage(w, h);
+			for (int y=0; y<h; y++) {
+				RGBA* row = usage.data() + y * w;
+				for (int x=0; x<w; x++) {
+					const size_t p = order.ys[y] + order.xs[x];
+					const size_t byte = offset + (pal4 ? p / 2 : pal8 ? p : p * 2);
+					row[x] = unpackColor(colorCodes[indices[byte / 8]]);
+				}
+			}
+			codeUsage->push_back(std::move(usage));
+		}
+
+		levels.push_back(std::move(img));
+		offset += bytes;
+
+		if (!mipmapped || size >= header.width) break;
+	}
+
+	return true;
+}
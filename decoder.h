@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "image.h"
+
+class Palette;
+
+// The header of a texture file
+struct TextureHeader {
+	int width = 0;			// For strided textures the real width, not the one in the file
+	int height = 0;
+	int textureType = 0;
+	int dataSize = 0;		// Bytes of texture data following the header
+};
+
+// Reads the header of a texture file in memory. Fails if the magic is wrong
+// or the texture data is cut off.
+bool readTextureHeader(const uint8_t* texture, size_t size, TextureHeader& header);
+
+// Decodes a texture file in memory, header included, into RGBA images. Works
+// for every format the converter writes. 'levels' receives one image per
+// mipmap level, smallest first, or just the one image. Paletted textures
+// need their palette. For compressed textures, 'codeUsage' (if given)
+// receives matching images that color every pixel by its codebook entry.
+bool decodeTexture(const uint8_t* texture, size_t size, const Palette* palette,
+				   std::vector<Image>& levels, std::vector<Image>* codeUsage = nullptr);
@@ -1,44 +1,350 @@
 #include "image.h"
 
+// stb_image keeps its failure reason in a static, which the parallel loads
+// in ImageContainer would race on. Nothing here reads it, which leaves the
+// function that sets it unused.
+#define STBI_NO_FAILURE_STRINGS
 #define STB_IMAGE_IMPLEMENTATION
 #define STB_IMAGE_WRITE_IMPLEMENTATION
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-function"
 #include "stb_image.h"
+#pragma GCC diagnostic pop
 #include "stb_image_write.h"
 
+#include <climits>
 #include <cstring>
-#include <iostream>
+#include <cmath>
+#include <fstream>
+#include <algorithm>
 
-Image::Image() : w(0), h(0), indexedMode(false) {}
-Image::Image(int width, int height) : w(width), h(height), indexedMode(false) {
-	pixels.resize(w*h);
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+static std::shared_ptr<RGBA> allocatePixels(int count) {
+	return std::shared_ptr<RGBA>(new RGBA[count](), std::default_delete<RGBA[]>());
+}
+
+Image::Image() : w(0), h(0), pixels(nullptr) {}
+Image::Image(int width, int height) : w(width), h(height) {
+	storage = allocatePixels(w*h);
+	pixels = storage.get();
+}
+
+Image::Image(int width, int height, RGBA* data, const std::shared_ptr<RGBA>& storage)
+	: w(width), h(height), pixels(data), storage(storage) {}
+
+Image::Image(const Image& other)
+	: w(other.w), h(other.h), pixels(nullptr) {
+	if (other.pixels) {
+		storage = allocatePixels(w*h);
+		pixels = storage.get();
+		std::memcpy(pixels, other.pixels, w*h*sizeof(RGBA));
+	}
 }
 
+Image::Image(Image&& other) noexcept
+	: w(other.w), h(other.h), pixels(other.pixels), storage(std::move(other.storage)) {
+	other.w = other.h = 0;
+	other.pixels = nullptr;
+}
+
+Image& Image::operator=(const Image& other) {
+	if (this != &other) *this = Image(other);
+	return *this;
+}
+
+Image& Image::operator=(Image&& other) noexcept {
+	if (this != &other) {
+		w = other.w;
+		h = other.h;
+		pixels = other.pixels;
+		storage = std::move(other.storage);
+		other.w = other.h = 0;
+		other.pixels = nullptr;
+	}
+	return *this;
+}
+
+#if !defined(_WIN32)
+namespace {
+
+// A read-only memory mapping of a whole file
+class MappedFile {
+public:
+	explicit MappedFile(const std::string& path) {
+		int fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0) return;
+		struct stat st;
+		if (fstat(fd, &st) == 0 && st.st_size > 0) {
+			void* mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (mapped != MAP_FAILED) {
+				addr = (const uint8_t*)mapped;
+				length = st.st_size;
+			}
+		}
+		close(fd);
+	}
+	~MappedFile() { if (addr) munmap((void*)addr, length); }
+
+	const uint8_t* data() const { return addr; }
+	size_t size() const { return length; }
+
+private:
+	const uint8_t* addr = nullptr;
+	size_t length = 0;
+};
+
+} // namespace
+#endif
+
 bool Image::loadFromFile(const std::string& path ) {
+	// Decode straight from a mapping of the file, and keep stb's buffer as
+	// the pixel storage instead of copying it.
 	int channels;
-	uint8_t* buffer = stbi_load(path.c_str(), &w, &h, &channels, STBI_rgb_alpha);
-	if (!buffer) {
-		std::cerr<<"[ERROR] Failed to load image: "<<path<<"\n";
+	uint8_t* buffer = nullptr;
+#if !defined(_WIN32)
+	MappedFile file(path);
+	if (file.data() && file.size() <= INT_MAX)
+		buffer = stbi_load_from_memory(file.data(), (int)file.size(), &w, &h, &channels, STBI_rgb_alpha);
+	else
+#endif
+		buffer = stbi_load(path.c_str(), &w, &h, &channels, STBI_rgb_alpha);
+	if (!buffer)
 		return false;
-	}
-	indexedMode=false;
-	pixels.resize(w*h);
-	std::memcpy(pixels.data(), buffer, w*h*4);
-	stbi_image_free(buffer);
+	static_assert(sizeof(RGBA) == 4, "RGBA must match stb's 4 channel layout");
+	storage = std::shared_ptr<RGBA>((RGBA*)buffer, [](RGBA* p) { stbi_image_free(p); });
+	pixels = storage.get();
 	return true;
 }
 
 
-bool Image::saveToFile(const std::string& path) const {
-	std::vector<uint8_t> buffer(w*h*4);
-	for(int y=0;y<h;y++) for(int x=0;x<w;x++) {
-		RGBA c=pixel(x,y);
-		int idx=(y*w+x)*4;
-		buffer[idx+0]=c.r;
-		buffer[idx+1]=c.g;
-		buffer[idx+2]=c.b;
-		buffer[idx+3]=c.a;
+namespace {
+
+// Writes a file and keeps a running CRC-32 of the bytes since the last
+// startCRC(), as needed for PNG chunks.
+class CRCWriter {
+public:
+	explicit CRCWriter(const std::string& path) : file(path, std::ios::binary) {
+		for (uint32_t i=0; i<256; i++) {
+			uint32_t c = i;
+			for (int k=0; k<8; k++) c = (c & 1) ? (0xEDB88320 ^ (c >> 1)) : (c >> 1);
+			table[i] = c;
+		}
+	}
+
+	bool ok() const { return file.good(); }
+
+	void write(const void* data, size_t size) {
+		const uint8_t* bytes = (const uint8_t*)data;
+		for (size_t i=0; i<size; i++)
+			crc = table[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+		file.write((const char*)data, size);
+	}
+	void writeBE32(uint32_t v) {
+		uint8_t bytes[4] = { (uint8_t)(v >> 24), (uint8_t)(v >> 16), (uint8_t)(v >> 8), (uint8_t)v };
+		write(bytes, 4);
+	}
+	void startCRC() { crc = 0xFFFFFFFF; }
+	uint32_t currentCRC() const { return crc ^ 0xFFFFFFFF; }
+
+private:
+	std::ofstream file;
+	uint32_t table[256];
+	uint32_t crc = 0xFFFFFFFF;
+};
+
+// PNG with the image data in uncompressed deflate blocks. Much bigger than
+// a normal PNG, but costs little more than copying the pixels.
+bool writeStoredPNG(const std::string& path, const RGBA* pixels, int w, int h) {
+	CRCWriter out(path);
+	if (!out.ok()) return false;
+
+	static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+	out.write(signature, 8);
+
+	out.writeBE32(13);
+	out.startCRC();
+	out.write("IHDR", 4);
+	out.writeBE32(w);
+	out.writeBE32(h);
+	static const uint8_t format[5] = { 8, 6, 0, 0, 0 }; // 8 bit RGBA, no interlacing
+	out.write(format, 5);
+	out.writeBE32(out.currentCRC());
+
+	// Every row starts with filter type 0, the rows are split into stored
+	// blocks of at most 65535 bytes.
+	const size_t rowSize = (size_t)w * 4 + 1;
+	const size_t rawSize = rowSize * h;
+	const size_t blocks = std::max<size_t>(1, (rawSize + 65534) / 65535);
+	out.writeBE32((uint32_t)(2 + rawSize + blocks * 5 + 4));
+	out.startCRC();
+	out.write("IDAT", 4);
+	static const uint8_t zlibHeader[2] = { 0x78, 0x01 };
+	out.write(zlibHeader, 2);
+
+	uint32_t adlerA = 1, adlerB = 0;
+	size_t blockLeft = 0, written = 0;
+	auto emit = [&](const uint8_t* data, size_t size) {
+		while (size > 0) {
+			if (blockLeft == 0) {
+				blockLeft = std::min<size_t>(65535, rawSize - written);
+				uint8_t header[5] = {
+					(uint8_t)(written + blockLeft == rawSize ? 1 : 0),
+					(uint8_t)blockLeft, (uint8_t)(blockLeft >> 8),
+					(uint8_t)~blockLeft, (uint8_t)(~blockLeft >> 8) };
+				out.write(header, 5);
+			}
+			size_t n = std::min(size, blockLeft);
+			out.write(data, n);
+			for (size_t i=0; i<n; i++) {
+				adlerA = (adlerA + data[i]) % 65521;
+				adlerB = (adlerB + adlerA) % 65521;
+			}
+			data += n;
+			size -= n;
+			blockLeft -= n;
+			written += n;
+		}
+	};
+
+	const uint8_t filter = 0;
+	for (int y=0; y<h; y++) {
+		emit(&filter, 1);
+		emit((const uint8_t*)(pixels + (size_t)y * w), (size_t)w * 4);
+	}
+	out.writeBE32((adlerB << 16) | adlerA);
+	out.writeBE32(out.currentCRC());
+
+	out.writeBE32(0);
+	out.startCRC();
+	out.write("IEND", 4);
+	out.writeBE32(out.currentCRC());
+	return out.ok();
+}
+
+// Netpbm: PPM drops the alpha channel, PAM keeps it
+bool writeNetpbm(const std::string& path, const RGBA* pixels, int w, int h, bool alpha) {
+	std::ofstream out(path, std::ios::binary);
+	if (!out) return false;
+
+	if (alpha) {
+		out << "P7\nWIDTH " << w << "\nHEIGHT " << h << "\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n";
+		out.write((const char*)pixels, (size_t)w * h * 4);
+	} else {
+		out << "P6\n" << w << " " << h << "\n255\n";
+		std::vector<uint8_t> row(w * 3);
+		for (int y=0; y<h; y++) {
+			const RGBA* src = pixels + (size_t)y * w;
+			for (int x=0; x<w; x++) {
+				row[x*3+0] = src[x].r;
+				row[x*3+1] = src[x].g;
+				row[x*3+2] = src[x].b;
+			}
+			out.write((const char*)row.data(), row.size());
+		}
+	}
+	return out.good();
+}
+
+// The Quite OK Image format, lossless and fast to both write and read
+bool writeQOI(const std::string& path, const RGBA* pixels, int w, int h) {
+	std::ofstream file(path, std::ios::binary);
+	if (!file) return false;
+
+	std::vector<uint8_t> out;
+	out.reserve(14 + (size_t)w * h * 5 / 4 + 8);
+	auto be32 = [&](uint32_t v) {
+		out.push_back(v >> 24); out.push_back(v >> 16); out.push_back(v >> 8); out.push_back(v);
+	};
+	out.insert(out.end(), { 'q', 'o', 'i', 'f' });
+	be32(w);
+	be32(h);
+	out.push_back(4);	// RGBA
+	out.push_back(0);	// sRGB
+
+	RGBA seen[64];
+	std::memset(seen, 0, sizeof(seen));
+	RGBA prev = { 0, 0, 0, 255 };
+	int run = 0;
+	const size_t count = (size_t)w * h;
+
+	for (size_t i=0; i<count; i++) {
+		const RGBA px = pixels[i];
+		const bool same = px.r == prev.r && px.g == prev.g && px.b == prev.b && px.a == prev.a;
+		if (same) {
+			run++;
+			if (run == 62 || i == count - 1) {
+				out.push_back(0xC0 | (run - 1));
+				run = 0;
+			}
+			continue;
+		}
+		if (run > 0) {
+			out.push_back(0xC0 | (run - 1));
+			run = 0;
+		}
+
+		const int hash = (px.r * 3 + px.g * 5 + px.b * 7 + px.a * 11) % 64;
+		const RGBA& cached = seen[hash];
+		if (cached.r == px.r && cached.g == px.g && cached.b == px.b && cached.a == px.a) {
+			out.push_back(hash);
+		} else {
+			seen[hash] = px;
+			if (px.a == prev.a) {
+				const int8_t dr = (int8_t)(px.r - prev.r);
+				const int8_t dg = (int8_t)(px.g - prev.g);
+				const int8_t db = (int8_t)(px.b - prev.b);
+				const int8_t drg = (int8_t)(dr - dg);
+				const int8_t dbg = (int8_t)(db - dg);
+				if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+					out.push_back(0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2));
+				} else if (dg >= -32 && dg <= 31 && drg >= -8 && drg <= 7 && dbg >= -8 && dbg <= 7) {
+					out.push_back(0x80 | (dg + 32));
+					out.push_back((drg + 8) << 4 | (dbg + 8));
+				} else {
+					out.push_back(0xFE);
+					out.push_back(px.r); out.push_back(px.g); out.push_back(px.b);
+				}
+			} else {
+				out.push_back(0xFF);
+				out.push_back(px.r); out.push_back(px.g); out.push_back(px.b); out.push_back(px.a);
+			}
+		}
+		prev = px;
 	}
-	return stbi_write_png(path.c_str(),w,h,4,buffer.data(),w*4)!=0;
+
+	static const uint8_t end[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+	out.insert(out.end(), end, end + 8);
+	file.write((const char*)out.data(), out.size());
+	return file.good();
+}
+
+std::string lowercaseExtension(const std::string& path) {
+	size_t dot = path.find_last_of('.');
+	if (dot == std::string::npos) return "";
+	std::string ext = path.substr(dot + 1);
+	std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+	return ext;
+}
+
+} // namespace
+
+bool Image::saveToFile(const std::string& path, bool fast) const {
+	const std::string ext = lowercaseExtension(path);
+	if (ext == "ppm") return writeNetpbm(path, pixels, w, h, false);
+	if (ext == "pam") return writeNetpbm(path, pixels, w, h, true);
+	if (ext == "qoi") return writeQOI(path, pixels, w, h);
+	if (fast) return writeStoredPNG(path, pixels, w, h);
+	return stbi_write_png(path.c_str(), w, h, 4, pixels, w*4) != 0;
 }
 
 int Image::width() const { return w; }
@@ -49,13 +355,17 @@ RGBA Image::pixel(int x,int y) const {
 }
 
 void Image::setPixel(int x,int y, RGBA pixel) {
-	if (!indexedMode) {
-		pixels[y*w+x] = pixel;
-	}
+	pixels[y*w+x] = pixel;
 }
 
 Image Image::scaled(int newW,int newH,bool nearest) const {
 	Image out(newW,newH);
+	scaled(out, nearest);
+	return out;
+}
+
+void Image::scaled(Image& out, bool nearest) const {
+	const int newW = out.w, newH = out.h;
 	if (nearest) {
 		for (int y=0;y<newH;y++) {
 			for (int x=0;x<newW;x++) {
@@ -67,8 +377,8 @@ Image Image::scaled(int newW,int newH,bool nearest) const {
 	} else {
 		for (int y=0;y<newH;y++) {
 			for (int x=0;x<newW;x++) {
-				float gx = (float)x * (w-1) / (float)(newW-1);
-				float gy = (float)y * (h-1) / (float)(newH-1);
+				float gx = (newW > 1) ? (float)x * (w-1) / (float)(newW-1) : (w-1) * 0.5f;
+				float gy = (newH > 1) ? (float)y * (h-1) / (float)(newH-1) : (h-1) * 0.5f;
 				int x0 = (int)gx;
 				int y0 = (int)gy;
 				int x1 = std::min(x0+1,w-1);
@@ -98,20 +408,238 @@ Image Image::scaled(int newW,int newH,bool nearest) const {
 			}
 		}
 	}
-	return out;
 }
 
-void Image::allocateIndexed(int colors) {
-	indexedMode=true;
-	indexed.assign(w*h,0);
+// Averages each 2x2 block of src into one pixel of dst, rounding to nearest.
+// Strides are in pixels.
+static void halve(const RGBA* src, int srcStride, RGBA* dst, int dstStride, int dstW, int dstH) {
+	for (int y=0; y<dstH; y++) {
+		const uint8_t* row0 = (const uint8_t*)(src + (y*2+0) * srcStride);
+		const uint8_t* row1 = (const uint8_t*)(src + (y*2+1) * srcStride);
+		uint8_t* out = (uint8_t*)(dst + y * dstStride);
+		int x = 0;
+
+#if defined(__SSE2__)
+		// 4 output pixels from 8x2 input pixels per iteration
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i two = _mm_set1_epi16(2);
+		for (; x+4<=dstW; x+=4) {
+			__m128i a0 = _mm_loadu_si128((const __m128i*)(row0 + x*8));
+			__m128i a1 = _mm_loadu_si128((const __m128i*)(row0 + x*8 + 16));
+			__m128i b0 = _mm_loadu_si128((const __m128i*)(row1 + x*8));
+			__m128i b1 = _mm_loadu_si128((const __m128i*)(row1 + x*8 + 16));
+
+			// Vertical sums, two pixels per register
+			__m128i p01 = _mm_add_epi16(_mm_unpacklo_epi8(a0, zero), _mm_unpacklo_epi8(b0, zero));
+			__m128i p23 = _mm_add_epi16(_mm_unpackhi_epi8(a0, zero), _mm_unpackhi_epi8(b0, zero));
+			__m128i p45 = _mm_add_epi16(_mm_unpacklo_epi8(a1, zero), _mm_unpacklo_epi8(b1, zero));
+			__m128i p67 = _mm_add_epi16(_mm_unpackhi_epi8(a1, zero), _mm_unpackhi_epi8(b1, zero));
+
+			// Horizontal sums of neighboring pixels
+			__m128i lo = _mm_add_epi16(_mm_unpacklo_epi64(p01, p23), _mm_unpackhi_epi64(p01, p23));
+			__m128i hi = _mm_add_epi16(_mm_unpacklo_epi64(p45, p67), _mm_unpackhi_epi64(p45, p67));
+			lo = _mm_srli_epi16(_mm_add_epi16(lo, two), 2);
+			hi = _mm_srli_epi16(_mm_add_epi16(hi, two), 2);
+			_mm_storeu_si128((__m128i*)(out + x*4), _mm_packus_epi16(lo, hi));
+		}
+#endif
+
+		for (; x<dstW; x++) {
+			for (int c=0; c<4; c++) {
+				int sum = row0[x*8+c] + row0[x*8+4+c] + row1[x*8+c] + row1[x*8+4+c];
+				out[x*4+c] = (uint8_t)((sum + 2) >> 2);
+			}
+		}
+	}
 }
 
-void Image::setIndexedPixel(int x,int y,uint8_t index) {
-	if(indexedMode) {
-		indexed[y*w+x]=index;
+void Image::boxMipChain(const std::vector<Image*>& chain) const {
+	// A single pixel has no smaller levels to make
+	if (chain.empty() || w < 2 || h < 2) return;
+
+	// Size of the source tiles, 16kB each
+	const int TILE = 64;
+	const int tileW = std::min(TILE, w);
+	const int tileH = std::min(TILE, h);
+
+	// Levels that can be made from a single tile
+	int tileLevels = 0;
+	for (int t=std::min(tileW, tileH); t>1 && tileLevels<(int)chain.size(); t/=2) tileLevels++;
+
+	for (int ty=0; ty<h; ty+=tileH) {
+		for (int tx=0; tx<w; tx+=tileW) {
+			const RGBA* src = data() + ty * w + tx;
+			int srcStride = w;
+			int srcW = tileW, srcH = tileH;
+			for (int k=0; k<tileLevels; k++) {
+				Image& level = *chain[k];
+				RGBA* dst = level.data() + (ty >> (k+1)) * level.w + (tx >> (k+1));
+				halve(src, srcStride, dst, level.w, srcW / 2, srcH / 2);
+				src = dst;
+				srcStride = level.w;
+				srcW /= 2;
+				srcH /= 2;
+			}
+		}
+	}
+
+	// Every tile is down to a single pixel, continue from the last level
+	if (tileLevels < (int)chain.size()) {
+		std::vector<Image*> rest(chain.begin() + tileLevels, chain.end());
+		chain[tileLevels-1]->boxMipChain(rest);
+	}
+}
+
+namespace {
+
+// Filter weights for resampling along one axis. Every output pixel has its
+// own run of source pixels and weights, computed once per resize.
+struct ResampleWeights {
+	std::vector<int> first;		// First source pixel for each output pixel
+	std::vector<int> count;		// Number of source pixels for each output pixel
+	std::vector<float> weights;	// 'taps' weights for each output pixel
+	int taps;
+};
+
+float kernelSupport(FilterMode kernel) {
+	switch (kernel) {
+	case TRIANGLE:	return 1.0f;
+	case LANCZOS:	return 3.0f;
+	default:		return 0.5f;
 	}
 }
-uint8_t Image::indexedPixelAt(int x,int y) const {
-	if(indexedMode) return indexed[y*w+x];
-	return 0;
+
+float kernelWeight(FilterMode kernel, float x) {
+	x = std::fabs(x);
+	switch (kernel) {
+	case TRIANGLE:
+		return (x < 1.0f) ? (1.0f - x) : 0.0f;
+	case LANCZOS: {
+		if (x < 1e-6f) return 1.0f;
+		if (x >= 3.0f) return 0.0f;
+		const float pix = (float)M_PI * x;
+		return 3.0f * std::sin(pix) * std::sin(pix / 3.0f) / (pix * pix);
+	}
+	default:
+		return (x <= 0.5f) ? 1.0f : 0.0f;
+	}
+}
+
+ResampleWeights computeWeights(int srcSize, int dstSize, FilterMode kernel) {
+	const float ratio = (float)srcSize / dstSize;
+	const float scale = std::max(1.0f, ratio);
+	const float radius = kernelSupport(kernel) * scale;
+
+	ResampleWeights rw;
+	rw.taps = (int)std::ceil(radius) * 2 + 1;
+	rw.first.resize(dstSize);
+	rw.count.resize(dstSize);
+	rw.weights.assign(dstSize * rw.taps, 0.0f);
+
+	for (int i=0; i<dstSize; i++) {
+		const float center = (i + 0.5f) * ratio;
+		const int lo = (int)std::floor(center - radius);
+		const int hi = (int)std::ceil(center + radius);
+		const int first = std::max(0, std::min(lo, srcSize-1));
+		const int last = std::max(0, std::min(hi, srcSize-1));
+		float* w = &rw.weights[i * rw.taps];
+
+		// Pixels outside the image are clamped to the edge
+		float sum = 0.0f;
+		for (int j=lo; j<=hi; j++) {
+			float weight = kernelWeight(kernel, (j + 0.5f - center) / scale);
+			if (weight == 0.0f) continue;
+			int k = std::max(first, std::min(j, last)) - first;
+			if (k >= rw.taps) continue;
+			w[k] += weight;
+			sum += weight;
+		}
+
+		if (sum != 0.0f) {
+			for (int k=0; k<rw.taps; k++) w[k] /= sum;
+		} else {
+			w[std::min((int)center, srcSize-1) - first] = 1.0f;
+		}
+
+		rw.first[i] = first;
+		rw.count[i] = std::min(last - first + 1, rw.taps);
+	}
+	return rw;
+}
+
+} // namespace
+
+Image Image::resampled(int newW, int newH, FilterMode kernel) const {
+	Image out(newW, newH);
+	resampled(out, kernel);
+	return out;
+}
+
+void Image::resampled(Image& out, FilterMode kernel) const {
+	const int newW = out.w, newH = out.h;
+	const ResampleWeights horz = computeWeights(w, newW, kernel);
+	const ResampleWeights vert = computeWeights(h, newH, kernel);
+
+	// Horizontal pass into a float RGBA buffer, then a vertical pass that
+	// accumulates whole rows at a time.
+	std::vector<float> tmp(newW * h * 4);
+	std::vector<float> acc(newW * 4);
+
+	for (int y=0; y<h; y++) {
+		const RGBA* src = data() + y * w;
+		float* dst = &tmp[y * newW * 4];
+		for (int x=0; x<newW; x++) {
+			const RGBA* s = src + horz.first[x];
+			const float* wt = &horz.weights[x * horz.taps];
+#if defined(__SSE2__)
+			__m128 sum = _mm_setzero_ps();
+			for (int t=0; t<horz.count[x]; t++) {
+				int32_t bits;
+				memcpy(&bits, &s[t], sizeof(bits));
+				__m128i v = _mm_cvtsi32_si128(bits);
+				v = _mm_unpacklo_epi16(_mm_unpacklo_epi8(v, _mm_setzero_si128()), _mm_setzero_si128());
+				sum = _mm_add_ps(sum, _mm_mul_ps(_mm_cvtepi32_ps(v), _mm_set1_ps(wt[t])));
+			}
+			_mm_storeu_ps(dst + x*4, sum);
+#else
+			float sum[4] = {0, 0, 0, 0};
+			for (int t=0; t<horz.count[x]; t++) {
+				sum[0] += s[t].r * wt[t];
+				sum[1] += s[t].g * wt[t];
+				sum[2] += s[t].b * wt[t];
+				sum[3] += s[t].a * wt[t];
+			}
+			memcpy(dst + x*4, sum, sizeof(sum));
+#endif
+		}
+	}
+
+	for (int y=0; y<newH; y++) {
+		const float* wt = &vert.weights[y * vert.taps];
+		std::fill(acc.begin(), acc.end(), 0.0f);
+		for (int t=0; t<vert.count[y]; t++) {
+			const float* row = &tmp[(vert.first[y] + t) * newW * 4];
+			int i = 0;
+#if defined(__SSE2__)
+			const __m128 weight = _mm_set1_ps(wt[t]);
+			for (; i<newW*4; i+=4)
+				_mm_storeu_ps(&acc[i], _mm_add_ps(_mm_loadu_ps(&acc[i]), _mm_mul_ps(_mm_loadu_ps(row + i), weight)));
+#endif
+			for (; i<newW*4; i++)
+				acc[i] += row[i] * wt[t];
+		}
+
+		RGBA* dst = out.data() + y * newW;
+		for (int x=0; x<newW; x++) {
+#if defined(__SSE2__)
+			__m128i v = _mm_cvtps_epi32(_mm_loadu_ps(&acc[x*4]));
+			v = _mm_packus_epi16(_mm_packs_epi32(v, v), v);
+			int32_t bits = _mm_cvtsi128_si32(v);
+			memcpy(&dst[x], &bits, sizeof(bits));
+#else
+			auto clamp = [](float v) { return (uint8_t)std::max(0.0f, std::min(255.0f, v + 0.5f)); };
+			dst[x] = RGBA{clamp(acc[x*4+0]), clamp(acc[x*4+1]), clamp(acc[x*4+2]), clamp(acc[x*4+3])};
+#endif
+		}
+	}
 }
\ No newline at end of file
@@ -2,6 +2,7 @@
 
 #include <string>
 #include <map>
+#include <memory>
 #include <vector>
 
 #include "common.h"
@@ -11,8 +12,20 @@ public:
 	Image();
 	Image(int width, int height);
 
+	// A view of pixels that live in a larger allocation, such as the mipmap
+	// arena of an ImageContainer. The view keeps the allocation alive.
+	Image(int width, int height, RGBA* data, const std::shared_ptr<RGBA>& storage);
+
+	// Copies are deep, even of views. Moves take over the pixels.
+	Image(const Image& other);
+	Image(Image&& other) noexcept;
+	Image& operator=(const Image& other);
+	Image& operator=(Image&& other) noexcept;
+
 	bool loadFromFile(const std::string& path);
-	bool saveToFile(const std::string& path) const;
+	// The format follows the extension: .ppm, .pam, .qoi or else PNG. With
+	// 'fast' set, PNGs are written without compression.
+	bool saveToFile(const std::string& path, bool fast = false) const;
 
 	int width() const;
 	int height() const;
@@ -21,16 +34,26 @@ public:
 	void setPixel(int x,int y, RGBA pixel);
 
 	Image scaled(int newW,int newH,bool nearest) const;
+	void scaled(Image& out, bool nearest) const;
+
+	// Fills 'chain' with successive mipmap levels, each half the size of the
+	// previous one, using a 2x2 box filter. The images in the chain must
+	// already have the right size. The image must be a power of two in size.
+	// Works on small tiles so all levels are made while the source pixels are
+	// still in the cache.
+	void boxMipChain(const std::vector<Image*>& chain) const;
 
-	void allocateIndexed(int colors);
-	void setIndexedPixel(int x,int y, uint8_t index);
-	uint8_t indexedPixelAt(int x,int y) const;
+	// Resizes to any size with a separable filter. Supports the BOX, TRIANGLE
+	// and LANCZOS (3 lobes) kernels; the kernel is widened when downscaling
+	// so it also acts as the low-pass filter.
+	Image resampled(int newW, int newH, FilterMode kernel) const;
+	void resampled(Image& out, FilterMode kernel) const;
 
-	bool isIndexed() const { return indexedMode; }
+	RGBA* data() { return pixels; }
+	const RGBA* data() const { return pixels; }
 
 private:
 	int w,h;
-	bool indexedMode;
-	std::vector<RGBA> pixels;
-	std::vector<uint8_t> indexed;
+	RGBA* pixels;					// Points into storage
+	std::shared_ptr<RGBA> storage;	// Owns the pixels, maybe shared with other views
 };
\ No newline at end of file
@@ -1,71 +1,202 @@
-#include <iostream>
 #include <algorithm>
 #include "imagecontainer.h"
+#include "threadpool.h"
+#include "stats.h"
+#include "log.h"
 #include "common.h"
 
-bool ImageContainer::load(const std::vector<std::string>& filenames, int textureType, int mipmapFilter) {
+// Picks the valid size for one dimension of an image as the resize mode asks.
+// Strided widths go in steps of 32, everything else in powers of two.
+static int resizeDimension(int size, int resizeMode, bool strided) {
+	if (strided) {
+		int rounded = (resizeMode == RESIZE_NEAREST_POW2) ? (size + 16) / 32 * 32 : size / 32 * 32;
+		return std::max(TEXTURE_STRIDE_MIN, std::min(rounded, TEXTURE_STRIDE_MAX));
+	}
+
+	int lower = TEXTURE_SIZE_MIN;
+	while (lower * 2 <= size && lower < TEXTURE_SIZE_MAX) lower *= 2;
+	if (resizeMode == RESIZE_NEAREST_POW2 && lower < TEXTURE_SIZE_MAX && (size - lower) > (lower * 2 - size))
+		return lower * 2;
+	return lower;
+}
+
+// Resizes an image that is not a valid texture size. The resampler doesn't
+// do bilinear or nearest-neighbor, so those use the closest alternative.
+static Image resizeToValid(const Image& img, int textureType, int mipmapFilter, int resizeMode) {
+	StatsTimer timer(PHASE_LOAD);
+	bool strided = (textureType & FLAG_STRIDED);
+	int newW = resizeDimension(img.width(), resizeMode, strided);
+	int newH = resizeDimension(img.height(), resizeMode, false);
+	if (textureType & FLAG_MIPMAPPED)
+		newW = newH = std::min(newW, newH);
+
+	logDebug("Resizing " + std::to_string(img.width()) + "x" + std::to_string(img.height())
+			 + " image to " + std::to_string(newW) + "x" + std::to_string(newH));
+
+	if (mipmapFilter == NEAREST)
+		return img.scaled(newW, newH, true);
+	if (mipmapFilter == LANCZOS)
+		return img.resampled(newW, newH, LANCZOS);
+	return img.resampled(newW, newH, TRIANGLE);
+}
+
+bool ImageContainer::load(const std::vector<std::string>& filenames, int textureType, int mipmapFilter, int resizeMode) {
 	bool mipmapped = (textureType & FLAG_MIPMAPPED);
 
 	if ((filenames.size() > 1) && !mipmapped) {
-		std::cerr << "[ERROR] Only one input file may be specified if no mipmap flag is set.\n";
+		logError("Only one input file may be specified if no mipmap flag is set.");
 		return false;
 	}
 
-	
-	for (const auto& filename : filenames) {
-		Image img;
-		if (!img.loadFromFile(filename)) { 
-			std::cerr << "[ERROR] Failed to load image: " << filename << "\n";
+	// Decode all inputs at once, then check them in order so the result
+	// and the messages don't depend on which decode finished first.
+	std::vector<Image> decoded(filenames.size());
+	std::vector<char> decodedOk(filenames.size(), 0);
+	{
+		StatsTimer timer(PHASE_LOAD);
+		ThreadPool::global().parallelFor((int)filenames.size(), [&](int i) {
+			decodedOk[i] = decoded[i].loadFromFile(filenames[i]);
+		});
+	}
+	for (size_t i = 0; i < filenames.size(); i++) {
+		if (!decodedOk[i]) {
+			logError("Failed to load image: " + filenames[i]);
 			return false;
 		}
+	}
+
+	return build(decoded, filenames, textureType, mipmapFilter, resizeMode);
+}
+
+bool ImageContainer::loadImages(std::vector<Image> images, int textureType, int mipmapFilter, int resizeMode) {
+	if ((images.size() > 1) && !(textureType & FLAG_MIPMAPPED)) {
+		logError("Only one input image may be given if no mipmap flag is set.");
+		return false;
+	}
+
+	std::vector<std::string> names;
+	for (size_t i = 0; i < images.size(); i++)
+		names.push_back("#" + std::to_string(i + 1));
+	return build(images, names, textureType, mipmapFilter, resizeMode);
+}
+
+bool ImageContainer::build(std::vector<Image>& images, const std::vector<std::string>& names, int textureType, int mipmapFilter, int resizeMode) {
+	bool mipmapped = (textureType & FLAG_MIPMAPPED);
+	unloadAll();
+
+	std::vector<Image> loaded;
+	for (size_t i = 0; i < images.size(); i++) {
+		const std::string& filename = names[i];
+		Image img = std::move(images[i]);
+
+		if (resizeMode != RESIZE_NONE) {
+			bool square = !mipmapped || img.width() == img.height();
+			if (!square || !isValidSize(img.width(), img.height(), textureType))
+				img = resizeToValid(img, textureType, mipmapFilter, resizeMode);
+		}
 
 		if (!isValidSize(img.width(), img.height(), textureType)) {
-			std::cerr << "[ERROR] Image " << filename
-					  << " has invalid texture size "
-					  << img.width() << "x" << img.height() << "\n";
+			logError("Image " + filename + " has invalid texture size "
+					 + std::to_string(img.width()) + "x" + std::to_string(img.height()));
 			return false;
 		}
 
 		if (mipmapped && img.width() != img.height()) {
-			std::cerr << "[ERROR] Image " << filename
-					  << " is not square. Mipmapped textures require square images.\n";
+			logError("Image " + filename + " is not square. Mipmapped textures require square images.");
 			return false;
 		}
 
 		textureWidth  = std::max(textureWidth, img.width());
 		textureHeight = std::max(textureHeight, img.height());
 
-		images[img.width()] = img;  
-		std::cout << "[INFO] Loaded image " << filename << "\n";
-	}
-
-	if (mipmapped) {
-		if (mipmapFilter == 0) { 
-			std::cout << "[INFO] Using nearest-neighbor filtering for mipmaps\n";
+		// A later image of the same size replaces the earlier one
+		auto same = std::find_if(loaded.begin(), loaded.end(),
+								 [&](const Image& other) { return other.width() == img.width(); });
+		if (same != loaded.end()) {
+			*same = std::move(img);
 		} else {
-			std::cout << "[INFO] Using bilinear filtering for mipmaps\n";
-		}
-
-		
-		for (int size = TEXTURE_SIZE_MAX/2; size >= 1; size /= 2) {
-			if (images.count(size*2) && !images.count(size)) {
-				Image mipmap = images[size*2].scaled(size, size,
-														 mipmapFilter == 0); 
-				images[size] = mipmap;
-				std::cout << "[INFO] Generated " << size << "x" << size << " mipmap\n";
-			}
+			loaded.push_back(std::move(img));
 		}
+		logDebug("Loaded image " + filename);
 	}
 
 	if (textureWidth < TEXTURE_SIZE_MIN || textureHeight < TEXTURE_SIZE_MIN) {
-		std::cerr << "[ERROR] At least one input image must be 8x8 or larger.\n";
+		logError("At least one input image must be 8x8 or larger.");
 		return false;
 	}
 
-	
-	keys.clear();
-	for (auto& kv : images) keys.push_back(kv.first);
-	std::sort(keys.begin(), keys.end());
+	levels.clear();
+	if (!mipmapped) {
+		levels.push_back(std::move(loaded[0]));
+		return true;
+	}
+
+	// A mipmapped texture has all sizes from 1x1 up to the largest input.
+	// Inputs keep their decoded pixels, the levels that need to be generated
+	// share one allocation, smallest first like in the texture.
+	std::vector<bool> present;
+	size_t arenaPixels = 0;
+	for (int size = 1; size <= textureWidth; size *= 2) {
+		bool isInput = std::any_of(loaded.begin(), loaded.end(),
+								   [&](const Image& img) { return img.width() == size; });
+		present.push_back(isInput);
+		if (!isInput) arenaPixels += size * size;
+	}
+	if (arenaPixels > 0)
+		arena = std::shared_ptr<RGBA>(new RGBA[arenaPixels], std::default_delete<RGBA[]>());
+
+	levels.reserve(present.size());
+	RGBA* next = arena.get();
+	for (int size = 1; size <= textureWidth; size *= 2) {
+		auto input = std::find_if(loaded.begin(), loaded.end(),
+								  [&](const Image& img) { return img.width() == size; });
+		if (input != loaded.end()) {
+			levels.push_back(std::move(*input));
+		} else {
+			levels.push_back(Image(size, size, next, arena));
+			next += size * size;
+		}
+	}
+	loaded.clear();
+
+	if (mipmapFilter == NEAREST) { 
+		logDebug("Using nearest-neighbor filtering for mipmaps");
+	} else if (mipmapFilter == BOX) {
+		logDebug("Using box filtering for mipmaps");
+	} else if (mipmapFilter == TRIANGLE) {
+		logDebug("Using triangle filtering for mipmaps");
+	} else if (mipmapFilter == LANCZOS) {
+		logDebug("Using Lanczos filtering for mipmaps");
+	} else {
+		logDebug("Using bilinear filtering for mipmaps");
+	}
+
+	// The largest level is always an input, generate the missing ones
+	// below it from the next size up, straight into the arena.
+	StatsTimer timer(PHASE_MIPMAPS);
+	for (int i = (int)levels.size() - 2; i >= 0; i--) {
+		if (present[i])
+			continue;
+
+		const Image& source = levels[i+1];
+		if (mipmapFilter == BOX) {
+			// Generate the whole run of missing levels in one go
+			std::vector<Image*> chain;
+			for (int j = i; j >= 0 && !present[j]; j--)
+				chain.push_back(&levels[j]);
+			source.boxMipChain(chain);
+			for (Image* mipmap : chain)
+				logDebug("Generated " + std::to_string(mipmap->width()) + "x" + std::to_string(mipmap->height()) + " mipmap");
+			i -= (int)chain.size() - 1;
+			continue;
+		}
+
+		if (mipmapFilter == TRIANGLE || mipmapFilter == LANCZOS)
+			source.resampled(levels[i], (FilterMode)mipmapFilter);
+		else
+			source.scaled(levels[i], mipmapFilter == NEAREST);
+		logDebug("Generated " + std::to_string(levels[i].width()) + "x" + std::to_string(levels[i].height()) + " mipmap");
+	}
 
 	return true;
 }
@@ -73,17 +204,32 @@ bool ImageContainer::load(const std::vector<std::string>& filenames, int texture
 void ImageContainer::unloadAll() {
 	textureWidth = 0;
 	textureHeight = 0;
-	images.clear();
-	keys.clear();
+	levels.clear();
+	arena.reset();
+}
+
+int ImageContainer::indexOfSize(int size) const {
+	for (int i=0; i<(int)levels.size(); i++)
+		if (levels[i].width() == size)
+			return i;
+	return -1;
 }
 
 const Image& ImageContainer::getByIndex(int index, bool ascending) const {
-	if (index >= (int)keys.size()) {
+	if (index >= (int)levels.size()) {
 		static Image dummy; 
 		return dummy;
 	} else {
-		int realIdx = ascending ? index : ((int)keys.size() - index - 1);
-		int size = keys[realIdx];
-		return images.at(size);
+		int realIdx = ascending ? index : ((int)levels.size() - index - 1);
+		return levels[realIdx];
+	}
+}
+
+const Image& ImageContainer::getBySize(int size) const {
+	int index = indexOfSize(size);
+	if (index < 0) {
+		static Image dummy;
+		return dummy;
 	}
+	return levels[index];
 }
\ No newline at end of file
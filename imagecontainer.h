@@ -1,30 +1,36 @@
 #pragma once
 
 #include <string>
-#include <map>
+#include <memory>
 #include <vector>
 #include "image.h"
 
 class ImageContainer {
 public:
 	
-	bool load(const std::vector<std::string>& filenames, int textureType, int mipmapFilter);
+	bool load(const std::vector<std::string>& filenames, int textureType, int mipmapFilter, int resizeMode = RESIZE_NONE);
+
+	// Same as load(), for images that are already in memory
+	bool loadImages(std::vector<Image> images, int textureType, int mipmapFilter, int resizeMode = RESIZE_NONE);
 
 	void unloadAll();
 
-	bool hasMipmaps() const { return images.size() > 1; }
-	bool hasSize(int size) const { return images.find(size) != images.end(); }
+	bool hasMipmaps() const { return levels.size() > 1; }
+	bool hasSize(int size) const { return indexOfSize(size) >= 0; }
 
 	const Image& getByIndex(int index, bool ascending=true) const;
-	const Image& getBySize(int size) const { return images.at(size); }
+	const Image& getBySize(int size) const;
 
-	int imageCount() const { return (int)images.size(); }
+	int imageCount() const { return (int)levels.size(); }
 	int width() const { return textureWidth; }
 	int height() const { return textureHeight; }
 
 private:
 	int textureWidth = 0;
 	int textureHeight = 0;
-	std::map<int, Image> images;   
-	std::vector<int> keys;			 
+	std::vector<Image> levels;		// Sorted by size, all views into arena
+	std::shared_ptr<RGBA> arena;	// Pixels of every level
+
+	int indexOfSize(int size) const;
+	bool build(std::vector<Image>& images, const std::vector<std::string>& names, int textureType, int mipmapFilter, int resizeMode);
 };
\ No newline at end of file
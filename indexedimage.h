@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+// An image of palette or codebook indices, one byte per pixel. Used for the
+// output of the color reducers and VQ encoders, which never need RGBA pixels.
+class IndexedImage {
+public:
+	IndexedImage() : w(0), h(0) {}
+	IndexedImage(int width, int height) : w(width), h(height), indices(width * height) {}
+
+	int width() const { return w; }
+	int height() const { return h; }
+
+	uint8_t pixel(int x, int y) const { return indices[y * w + x]; }
+	void setPixel(int x, int y, uint8_t index) { indices[y * w + x] = index; }
+
+	// The 'width' indices of row y, for code that handles a row at a time.
+	uint8_t* row(int y) { return &indices[y * w]; }
+	const uint8_t* row(int y) const { return &indices[y * w]; }
+
+private:
+	int w, h;
+	std::vector<uint8_t> indices;
+};
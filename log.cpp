@@ -0,0 +1,78 @@
+#include <iostream>
+#include "log.h"
+
+#define REDCOLOR	   "\033[31m"
+#define YELLOWCOLOR     "\033[33m"
+#define NOCOLOR	        "\033[0m"
+
+bool g_verbose = false;
+
+static std::mutex g_consoleMutex;
+static thread_local LogBuffer* t_activeBuffer = nullptr;
+
+// Callers hold g_consoleMutex
+static void print(LogLevel level, const std::string& message) {
+	switch (level) {
+	case LOG_DEBUG:
+		std::cout << message << "\n";
+		break;
+	case LOG_INFO:
+		std::cout << "[INFO] " << message << "\n";
+		break;
+	case LOG_WARNING:
+		std::cout.flush();
+		std::cerr << YELLOWCOLOR << "[WARNING] " << message << NOCOLOR << "\n";
+		break;
+	case LOG_ERROR:
+		std::cout.flush();
+		std::cerr << REDCOLOR << "[ERROR] " << message << NOCOLOR << "\n";
+		break;
+	}
+}
+
+void logMessage(LogLevel level, const std::string& message) {
+	LogBuffer* buffer = t_activeBuffer;
+	if (buffer) {
+		buffer->add(level, message);
+	} else {
+		std::lock_guard<std::mutex> lock(g_consoleMutex);
+		print(level, message);
+		std::cout.flush();
+	}
+}
+
+LogBuffer::LogBuffer() : previous(t_activeBuffer) {
+	t_activeBuffer = this;
+}
+
+LogBuffer::~LogBuffer() {
+	t_activeBuffer = previous;
+	flush();
+}
+
+LogBuffer* LogBuffer::active() {
+	return t_activeBuffer;
+}
+
+void LogBuffer::setActive(LogBuffer* buffer) {
+	t_activeBuffer = buffer;
+}
+
+void LogBuffer::add(LogLevel level, const std::string& message) {
+	std::lock_guard<std::mutex> lock(mutex);
+	messages.push_back(std::make_pair(level, message));
+}
+
+void LogBuffer::flush() {
+	std::vector<std::pair<LogLevel, std::string>> pending;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		pending.swap(messages);
+	}
+	if (pending.empty()) return;
+
+	std::lock_guard<std::mutex> lock(g_consoleMutex);
+	for (const auto& m : pending)
+		print(m.first, m.second);
+	std::cout.flush();
+}
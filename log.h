@@ -0,0 +1,60 @@
+#pragma once
+
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+enum LogLevel {
+	LOG_DEBUG,		// Only shown with --verbose
+	LOG_INFO,
+	LOG_WARNING,
+	LOG_ERROR
+};
+
+// Show debug messages. Set by --verbose.
+extern bool g_verbose;
+
+// Prints a message, or adds it to the active LogBuffer. Safe to call from
+// any thread; a message is never mixed up with another one.
+void logMessage(LogLevel level, const std::string& message);
+
+inline void logDebug(const std::string& msg) {
+	if (g_verbose) logMessage(LOG_DEBUG, msg);
+}
+inline void logInfo(const std::string& msg) {
+	logMessage(LOG_INFO, msg);
+}
+inline void logWarning(const std::string& msg) {
+	logMessage(LOG_WARNING, msg);
+}
+inline void logError(const std::string& msg) {
+	logMessage(LOG_ERROR, msg);
+}
+
+// Holds back all messages while it exists and prints them in one go when it
+// is destroyed, so the output of one texture stays together and the console
+// isn't flushed for every line. Meant to be created on the main thread
+// around the work for one texture. Each thread has its own active buffer;
+// ThreadPool hands the submitting thread's buffer on to its tasks, so
+// messages from worker threads end up in it too.
+class LogBuffer {
+public:
+	LogBuffer();
+	~LogBuffer();
+
+	LogBuffer(const LogBuffer&) = delete;
+	LogBuffer& operator=(const LogBuffer&) = delete;
+
+	void add(LogLevel level, const std::string& message);
+	void flush();
+
+	// The buffer messages from the calling thread go to, or null
+	static LogBuffer* active();
+	static void setActive(LogBuffer* buffer);
+
+private:
+	std::mutex mutex;
+	std::vector<std::pair<LogLevel, std::string>> messages;
+	LogBuffer* previous;
+};
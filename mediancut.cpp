@@ -0,0 +1,237 @@
+#include "mediancut.h"
+#include "imagecontainer.h"
+#include "palette.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <cfloat>
+
+// One occupied histogram cell
+struct Bin {
+	int cell = 0;
+	int count = 0;
+	float sum[4] = { 0, 0, 0, 0 };	// A, R, G, B
+	float mean(int c) const { return sum[c] / count; }
+};
+
+// A range of bins in the sorted bin array
+struct Box {
+	int first, last;
+	float error;	// Count weighted squared error around the box mean
+	int axis;		// Channel with the largest spread
+};
+
+static inline int binIndex(const RGBA& c) {
+	return ((c.a >> 3) << 15) | ((c.r >> 3) << 10) | ((c.g >> 3) << 5) | (c.b >> 3);
+}
+
+static inline void channels(const RGBA& c, float out[4]) {
+	out[0] = c.a;
+	out[1] = c.r;
+	out[2] = c.g;
+	out[3] = c.b;
+}
+
+static void measureBox(const std::vector<Bin>& bins, Box& box) {
+	double count = 0, sum[4] = { 0, 0, 0, 0 }, sumSq[4] = { 0, 0, 0, 0 };
+	for (int i=box.first; i<=box.last; i++) {
+		const Bin& bin = bins[i];
+		count += bin.count;
+		for (int c=0; c<4; c++) {
+			const double m = bin.mean(c);
+			sum[c] += m * bin.count;
+			sumSq[c] += m * m * bin.count;
+		}
+	}
+
+	box.error = 0;
+	box.axis = 0;
+	double widest = -1;
+	for (int c=0; c<4; c++) {
+		const double variance = sumSq[c] - sum[c] * sum[c] / count;
+		box.error += (float)variance;
+		if (variance > widest) {
+			widest = variance;
+			box.axis = c;
+		}
+	}
+}
+
+static void boxMean(const std::vector<Bin>& bins, const Box& box, float out[4]) {
+	double count = 0, sum[4] = { 0, 0, 0, 0 };
+	for (int i=box.first; i<=box.last; i++) {
+		count += bins[i].count;
+		for (int c=0; c<4; c++) sum[c] += bins[i].sum[c];
+	}
+	for (int c=0; c<4; c++) out[c] = (float)(sum[c] / count);
+}
+
+static int findClosest(const std::vector<std::vector<float>>& colors, const float color[4]) {
+	int closest = 0;
+	float closestDistance = FLT_MAX;
+	for (size_t i=0; i<colors.size(); i++) {
+		float distance = 0;
+		for (int c=0; c<4; c++) {
+			const float d = colors[i][c] - color[c];
+			distance += d * d;
+		}
+		if (distance < closestDistance) {
+			closestDistance = distance;
+			closest = (int)i;
+		}
+	}
+	return closest;
+}
+
+// Builds the palette for the histogram of all image sets. On return 'cells'
+// maps every occupied histogram cell to its palette index.
+static void buildPalette(const std::vector<const ImageContainer*>& imageSets, int maxColors, int kmeansPasses, Palette& palette, std::vector<int>& cells) {
+	// Build the histogram. 'cells' first counts pixels per cell, then maps
+	// each occupied cell to its position in 'bins'.
+	cells.assign(1 << 20, 0);
+	for (const ImageContainer* images : imageSets) {
+		for (int i=0; i<images->imageCount(); i++) {
+			const Image& img = images->getByIndex(i);
+			for (int y=0; y<img.height(); y++)
+				for (int x=0; x<img.width(); x++)
+					cells[binIndex(img.pixel(x, y))]++;
+		}
+	}
+
+	std::vector<Bin> bins;
+	for (size_t i=0; i<cells.size(); i++) {
+		if (cells[i] > 0) {
+			cells[i] = (int)bins.size();
+			bins.push_back(Bin());
+			bins.back().cell = (int)i;
+		} else {
+			cells[i] = -1;
+		}
+	}
+
+	for (const ImageContainer* images : imageSets) {
+		for (int i=0; i<images->imageCount(); i++) {
+			const Image& img = images->getByIndex(i);
+			for (int y=0; y<img.height(); y++) {
+				for (int x=0; x<img.width(); x++) {
+					const RGBA px = img.pixel(x, y);
+					Bin& bin = bins[cells[binIndex(px)]];
+					float c[4];
+					channels(px, c);
+					bin.count++;
+					for (int k=0; k<4; k++) bin.sum[k] += c[k];
+				}
+			}
+		}
+	}
+
+	// Median cut: keep splitting the box with the largest error at the
+	// weighted median of its widest channel.
+	std::vector<Box> boxes(1);
+	boxes[0].first = 0;
+	boxes[0].last = (int)bins.size() - 1;
+	measureBox(bins, boxes[0]);
+
+	while ((int)boxes.size() < maxColors) {
+		int worst = -1;
+		for (size_t i=0; i<boxes.size(); i++)
+			if (boxes[i].first < boxes[i].last && (worst < 0 || boxes[i].error > boxes[worst].error))
+				worst = (int)i;
+		if (worst < 0 || boxes[worst].error <= 0) break;
+
+		Box& box = boxes[worst];
+		const int axis = box.axis;
+		std::sort(bins.begin() + box.first, bins.begin() + box.last + 1,
+				  [axis](const Bin& a, const Bin& b) { return a.mean(axis) < b.mean(axis); });
+
+		int64_t total = 0;
+		for (int i=box.first; i<=box.last; i++) total += bins[i].count;
+		int64_t running = 0;
+		int split = box.first;
+		for (; split < box.last - 1; split++) {
+			running += bins[split].count;
+			if (running * 2 >= total) break;
+		}
+
+		Box upper;
+		upper.first = split + 1;
+		upper.last = box.last;
+		box.last = split;
+		measureBox(bins, box);
+		measureBox(bins, upper);
+		boxes.push_back(upper);
+	}
+
+	std::vector<std::vector<float>> colors(boxes.size(), std::vector<float>(4));
+	for (size_t i=0; i<boxes.size(); i++)
+		boxMean(bins, boxes[i], colors[i].data());
+
+	std::vector<int> binToColor(bins.size());
+	for (size_t i=0; i<boxes.size(); i++)
+		for (int j=boxes[i].first; j<=boxes[i].last; j++)
+			binToColor[j] = (int)i;
+
+	// Optional k-means polish over the weighted bins
+	for (int pass=0; pass<kmeansPasses; pass++) {
+		std::vector<double> sums(colors.size() * 4, 0.0);
+		std::vector<double> counts(colors.size(), 0.0);
+		for (size_t i=0; i<bins.size(); i++) {
+			float c[4];
+			for (int k=0; k<4; k++) c[k] = bins[i].mean(k);
+			binToColor[i] = findClosest(colors, c);
+			counts[binToColor[i]] += bins[i].count;
+			for (int k=0; k<4; k++) sums[binToColor[i] * 4 + k] += bins[i].sum[k];
+		}
+		for (size_t i=0; i<colors.size(); i++)
+			if (counts[i] > 0)
+				for (int k=0; k<4; k++) colors[i][k] = (float)(sums[i * 4 + k] / counts[i]);
+	}
+	if (kmeansPasses > 0) {
+		for (size_t i=0; i<bins.size(); i++) {
+			float c[4];
+			for (int k=0; k<4; k++) c[k] = bins[i].mean(k);
+			binToColor[i] = findClosest(colors, c);
+		}
+	}
+
+	// Different boxes can round to the same color, so look up the final
+	// palette index of every box color.
+	palette.clear();
+	std::vector<int> colorToIndex(colors.size());
+	for (size_t i=0; i<colors.size(); i++) {
+		RGBA c;
+		c.a = (uint8_t)(colors[i][0] + 0.5f);
+		c.r = (uint8_t)(colors[i][1] + 0.5f);
+		c.g = (uint8_t)(colors[i][2] + 0.5f);
+		c.b = (uint8_t)(colors[i][3] + 0.5f);
+		palette.insert(packColor(c));
+		colorToIndex[i] = palette.indexOf(packColor(c));
+	}
+
+	// Sorting moved the bins around, so this goes by the cell of each bin
+	for (size_t i=0; i<bins.size(); i++)
+		cells[bins[i].cell] = colorToIndex[binToColor[i]];
+}
+
+void medianCut(const ImageContainer& images, int maxColors, int kmeansPasses, Palette& palette, std::vector<IndexedImage>& indexedImages) {
+	StatsTimer timer(PHASE_MEDIAN_CUT);
+	std::vector<int> cells;
+	buildPalette({ &images }, maxColors, kmeansPasses, palette, cells);
+
+	for (int i=0; i<images.imageCount(); i++) {
+		const Image& img = images.getByIndex(i);
+		IndexedImage indexed(img.width(), img.height());
+		for (int y=0; y<img.height(); y++) {
+			uint8_t* row = indexed.row(y);
+			for (int x=0; x<img.width(); x++)
+				row[x] = (uint8_t)cells[binIndex(img.pixel(x, y))];
+		}
+		indexedImages.push_back(std::move(indexed));
+	}
+}
+
+void medianCut(const std::vector<const ImageContainer*>& imageSets, int maxColors, int kmeansPasses, Palette& palette) {
+	StatsTimer timer(PHASE_MEDIAN_CUT);
+	std::vector<int> cells;
+	buildPalette(imageSets, maxColors, kmeansPasses, palette, cells);
+}
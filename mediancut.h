@@ -0,0 +1,18 @@
+#pragma once
+
+#include <vector>
+#include "indexedimage.h"
+
+class ImageContainer;
+class Palette;
+
+// Reduces the colors of all images to at most maxColors using median cut over
+// a 5 bits per channel ARGB histogram, followed by kmeansPasses k-means passes
+// over the histogram to polish the result. Works on color counts rather than
+// on one vector per pixel, so the cost barely depends on the image size.
+// indexedImages receives one indexed image per level, smallest first.
+void medianCut(const ImageContainer& images, int maxColors, int kmeansPasses, Palette& palette, std::vector<IndexedImage>& indexedImages);
+
+// Builds one palette from the histogram of several sets of images together,
+// without indexing them.
+void medianCut(const std::vector<const ImageContainer*>& imageSets, int maxColors, int kmeansPasses, Palette& palette);
@@ -0,0 +1,145 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include "metrics.h"
+#include "common.h"
+#include "decoder.h"
+#include "image.h"
+#include "imagecontainer.h"
+#include "stats.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Sum of squared differences of 'count' RGBA pixels. Alpha differences are
+// left out unless 'alpha' is set.
+static uint64_t sumSquaredDifferences(const uint8_t* a, const uint8_t* b, int count, bool alpha) {
+	uint64_t total = 0;
+	int i = 0;
+
+#if defined(__SSE2__)
+	// 4 pixels per iteration. The 32-bit sums grow by at most 4*255^2 per
+	// iteration, so they are moved into 'total' before they can overflow.
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i mask = alpha ? _mm_set1_epi16(-1) : _mm_set_epi16(0, -1, -1, -1, 0, -1, -1, -1);
+	const int BATCH = 2048;
+	while (i+4 <= count) {
+		__m128i sums = zero;
+		const int end = std::min(count & ~3, i + BATCH*4);
+		for (; i<end; i+=4) {
+			__m128i pa = _mm_loadu_si128((const __m128i*)(a + i*4));
+			__m128i pb = _mm_loadu_si128((const __m128i*)(b + i*4));
+			__m128i lo = _mm_sub_epi16(_mm_unpacklo_epi8(pa, zero), _mm_unpacklo_epi8(pb, zero));
+			__m128i hi = _mm_sub_epi16(_mm_unpackhi_epi8(pa, zero), _mm_unpackhi_epi8(pb, zero));
+			sums = _mm_add_epi32(sums, _mm_madd_epi16(lo, _mm_and_si128(lo, mask)));
+			sums = _mm_add_epi32(sums, _mm_madd_epi16(hi, _mm_and_si128(hi, mask)));
+		}
+		uint32_t lanes[4];
+		_mm_storeu_si128((__m128i*)lanes, sums);
+		total += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+	}
+#endif
+
+	const int channels = alpha ? 4 : 3;
+	for (; i<count; i++) {
+		for (int c=0; c<channels; c++) {
+			int d = a[i*4+c] - b[i*4+c];
+			total += d * d;
+		}
+	}
+	return total;
+}
+
+double meanSquaredError(const Image& a, const Image& b, bool alpha) {
+	const int count = a.width() * a.height();
+	if (count == 0) return 0;
+	uint64_t sum = sumSquaredDifferences((const uint8_t*)a.data(), (const uint8_t*)b.data(), count, alpha);
+	return (double)sum / ((double)count * (alpha ? 4 : 3));
+}
+
+double psnrFromMSE(double mse) {
+	if (mse <= 0) return std::numeric_limits<double>::infinity();
+	return 10.0 * std::log10(255.0 * 255.0 / mse);
+}
+
+static std::vector<float> luma(const Image& img) {
+	const int count = img.width() * img.height();
+	std::vector<float> out(count);
+	const RGBA* px = img.data();
+	for (int i=0; i<count; i++)
+		out[i] = 0.299f * px[i].r + 0.587f * px[i].g + 0.114f * px[i].b;
+	return out;
+}
+
+double structuralSimilarity(const Image& a, const Image& b) {
+	const int w = a.width(), h = a.height();
+	if (w == 0 || h == 0) return 1;
+
+	const double C1 = (0.01 * 255) * (0.01 * 255);
+	const double C2 = (0.03 * 255) * (0.03 * 255);
+	const int WINDOW = 8;
+	const int winW = std::min(WINDOW, w), winH = std::min(WINDOW, h);
+	const std::vector<float> la = luma(a), lb = luma(b);
+
+	double total = 0;
+	int windows = 0;
+	for (int wy=0; wy+winH<=h; wy+=std::max(1, winH/2)) {
+		for (int wx=0; wx+winW<=w; wx+=std::max(1, winW/2)) {
+			double sa = 0, sb = 0, saa = 0, sbb = 0, sab = 0;
+			for (int y=wy; y<wy+winH; y++) {
+				for (int x=wx; x<wx+winW; x++) {
+					double va = la[y*w+x], vb = lb[y*w+x];
+					sa += va; sb += vb;
+					saa += va*va; sbb += vb*vb; sab += va*vb;
+				}
+			}
+			const double n = winW * winH;
+			double ma = sa/n, mb = sb/n;
+			double varA = saa/n - ma*ma, varB = sbb/n - mb*mb, cov = sab/n - ma*mb;
+			total += ((2*ma*mb + C1) * (2*cov + C2)) / ((ma*ma + mb*mb + C1) * (varA + varB + C2));
+			windows++;
+		}
+	}
+	return total / windows;
+}
+
+bool measureTexture(const uint8_t* texture, size_t size, const Palette* palette, const ImageContainer& images,
+					bool ssim, std::vector<LevelMetrics>& metrics) {
+	StatsTimer timer(PHASE_METRICS);
+	TextureHeader header;
+	std::vector<Image> decoded;
+	if (!readTextureHeader(texture, size, header) || !decodeTexture(texture, size, palette, decoded))
+		return false;
+
+	const int pixelFormat = (header.textureType >> PIXELFORMAT_SHIFT) & PIXELFORMAT_MASK;
+	const bool alpha = (pixelFormat == PIXELFORMAT_ARGB1555 || pixelFormat == PIXELFORMAT_ARGB4444 || isPaletted(header.textureType));
+
+	metrics.clear();
+	for (int i=(int)decoded.size()-1; i>=0; i--) {
+		const Image& level = decoded[i];
+		if (!images.hasSize(level.width()))
+			return false;
+		const Image& source = images.getBySize(level.width());
+		if (source.height() != level.height())
+			return false;
+
+		LevelMetrics m;
+		m.width = level.width();
+		m.height = level.height();
+		m.mse = meanSquaredError(source, level, alpha);
+		m.psnr = psnrFromMSE(m.mse);
+		if (ssim) m.ssim = structuralSimilarity(source, level);
+		metrics.push_back(m);
+	}
+	return true;
+}
+
+double overallPSNR(const std::vector<LevelMetrics>& metrics) {
+	double weighted = 0, pixels = 0;
+	for (const auto& m : metrics) {
+		weighted += m.mse * m.width * m.height;
+		pixels += (double)m.width * m.height;
+	}
+	return psnrFromMSE(pixels > 0 ? weighted / pixels : 0);
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+class Image;
+class ImageContainer;
+class Palette;
+
+// How close one level of a converted texture is to its source image
+struct LevelMetrics {
+	int width = 0;
+	int height = 0;
+	double mse = 0;		// Mean squared error per channel
+	double psnr = 0;	// In dB, infinity if the level is exact
+	double ssim = 1;	// Of the luma, only filled in when asked for
+};
+
+// Mean squared error per channel of two images of the same size. The alpha
+// channel only counts if 'alpha' is set.
+double meanSquaredError(const Image& a, const Image& b, bool alpha);
+
+// PSNR in dB for 8-bit channels, infinity for an MSE of 0.
+double psnrFromMSE(double mse);
+
+// Mean SSIM of the luma of two images of the same size, over 8x8 windows
+// that overlap by half. Images smaller than a window are one window.
+double structuralSimilarity(const Image& a, const Image& b);
+
+// Decodes a texture file in memory and measures every level against the
+// level of the same size in 'images'. 'metrics' receives the levels largest
+// first. Paletted textures need their palette. Fails if the texture can't
+// be decoded or a level has no source image.
+bool measureTexture(const uint8_t* texture, size_t size, const Palette* palette, const ImageContainer& images,
+					bool ssim, std::vector<LevelMetrics>& metrics);
+
+// PSNR of all levels together, each weighted by its number of pixels.
+double overallPSNR(const std::vector<LevelMetrics>& metrics);
@@ -0,0 +1,271 @@
+// Microbenchmarks of the kernels the converters spend their time in. Each
+// kernel is run untimed until it's warm, then timed a number of times, and
+// the percentiles of the time per item are reported. No files are read or
+// written, so the numbers only move when the kernels do.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include "common.h"
+#include "image.h"
+#include "imagecontainer.h"
+#include "log.h"
+#include "palette.h"
+#include "twiddler.h"
+
+namespace {
+
+struct Options {
+	std::string filter;		// Only kernels whose name contains this
+	int repetitions = 30;
+	double warmupMs = 50;
+};
+
+Options opts;
+
+// Results are folded into this, so the compiler can't drop the work
+volatile uint64_t sink;
+
+typedef std::chrono::steady_clock Clock;
+
+double percentile(const std::vector<double>& sorted, double p) {
+	size_t rank = (size_t)std::ceil(p * sorted.size());
+	return sorted[std::max<size_t>(rank, 1) - 1];
+}
+
+// Times 'kernel', which processes 'items' items per call, and prints the
+// time per item in nanoseconds.
+void run(const std::string& name, int64_t items, const std::function<uint64_t()>& kernel) {
+	if (name.find(opts.filter) == std::string::npos)
+		return;
+
+	// At least one warm-up call, more until the caches and branch
+	// predictors have settled
+	auto warmupStart = Clock::now();
+	do {
+		sink = sink + kernel();
+	} while (std::chrono::duration<double, std::milli>(Clock::now() - warmupStart).count() < opts.warmupMs);
+
+	std::vector<double> times;
+	for (int r=0; r<opts.repetitions; r++) {
+		auto start = Clock::now();
+		uint64_t result = kernel();
+		double ns = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+		sink = sink + result;
+		times.push_back(ns / items);
+	}
+	std::sort(times.begin(), times.end());
+
+	const double median = percentile(times, 0.5);
+	std::printf("%-32s %9lld %10.3f %10.3f %10.3f %10.3f %10.2f\n", name.c_str(), (long long)items,
+				times.front(), median, percentile(times, 0.9), percentile(times, 0.99), 1e3 / median);
+	std::fflush(stdout);
+}
+
+std::vector<RGBA> randomPixels(int count, uint32_t seed) {
+	std::mt19937 random(seed);
+	std::vector<RGBA> pixels(count);
+	for (auto& px : pixels) {
+		uint32_t v = random();
+		px = { (uint8_t)v, (uint8_t)(v >> 8), (uint8_t)(v >> 16), (uint8_t)(v >> 24) };
+	}
+	return pixels;
+}
+
+Image randomImage(int w, int h, uint32_t seed) {
+	std::vector<RGBA> pixels = randomPixels(w * h, seed);
+	Image img(w, h);
+	std::copy(pixels.begin(), pixels.end(), img.data());
+	return img;
+}
+
+void benchTwiddler() {
+	const int SIZE = 1024;
+	run("twiddler/construct 1024", SIZE * SIZE, [] {
+		Twiddler twiddler(SIZE, SIZE);
+		return (uint64_t)twiddler.index(SIZE * SIZE - 1);
+	});
+
+	const Twiddler twiddler(SIZE, SIZE);
+	run("twiddler/index(i) 1024", SIZE * SIZE, [&] {
+		uint64_t sum = 0;
+		for (int i=0; i<SIZE*SIZE; i++)
+			sum += twiddler.index(i);
+		return sum;
+	});
+	run("twiddler/index(x,y) 1024", SIZE * SIZE, [&] {
+		uint64_t sum = 0;
+		for (int y=0; y<SIZE; y++)
+			for (int x=0; x<SIZE; x++)
+				sum += twiddler.index(x, y);
+		return sum;
+	});
+}
+
+// One search of a full 256 code book per item
+template<uint N>
+void benchFindClosest() {
+	const int CODES = 256, VECTORS = 4096;
+	std::mt19937 random(N);
+	std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+
+	VectorQuantizer<N> vq;
+	vq.codes.resize(CODES);
+	for (auto& code : vq.codes)
+		for (uint i=0; i<N; i++) code.codeVec[i] = unit(random);
+
+	std::vector<Vec<N>> vectors(VECTORS);
+	for (auto& vec : vectors)
+		for (uint i=0; i<N; i++) vec[i] = unit(random);
+
+	run("vq/findClosest<" + std::to_string(N) + "> 256", VECTORS, [&] {
+		uint64_t sum = 0;
+		for (const auto& vec : vectors)
+			sum += vq.findClosest(vec);
+		return sum;
+	});
+}
+
+void benchPixelFormats() {
+	const int COUNT = 1 << 16;
+	const std::vector<RGBA> pixels = randomPixels(COUNT, 1);
+
+	static const struct { const char* name; int format; } formats[] = {
+		{ "ARGB1555", PIXELFORMAT_ARGB1555 },
+		{ "RGB565",   PIXELFORMAT_RGB565 },
+		{ "ARGB4444", PIXELFORMAT_ARGB4444 },
+	};
+	for (const auto& f : formats) {
+		const int format = f.format;
+		run(std::string("pixel/to16BPP ") + f.name, COUNT, [&] {
+			uint64_t sum = 0;
+			for (const RGBA& px : pixels)
+				sum += to16BPP(px, format);
+			return sum;
+		});
+
+		std::vector<uint16_t> packed(COUNT);
+		for (int i=0; i<COUNT; i++)
+			packed[i] = to16BPP(pixels[i], format);
+		run(std::string("pixel/to32BPP ") + f.name, COUNT, [&] {
+			uint64_t sum = 0;
+			for (uint16_t px : packed) {
+				RGBA c = to32BPP(px, format);
+				sum += c.r + c.g + c.b + c.a;
+			}
+			return sum;
+		});
+	}
+
+	// Per pixel, although the conversion takes two at a time
+	run("pixel/RGBtoYUV422", COUNT, [&] {
+		uint64_t sum = 0;
+		for (int i=0; i<COUNT; i+=2) {
+			uint16_t yuv1, yuv2;
+			RGBtoYUV422(pixels[i], pixels[i+1], yuv1, yuv2);
+			sum += yuv1 + yuv2;
+		}
+		return sum;
+	});
+
+	run("pixel/toSpherical", COUNT, [&] {
+		uint64_t sum = 0;
+		for (const RGBA& px : pixels)
+			sum += toSpherical(px);
+		return sum;
+	});
+}
+
+// Per output pixel
+void benchScaling() {
+	const Image source = randomImage(1024, 1024, 2);
+	Image out(512, 512);
+	run("image/scaled nearest 1024>512", 512 * 512, [&] {
+		source.scaled(out, true);
+		return (uint64_t)out.data()[0].r;
+	});
+	run("image/scaled bilinear 1024>512", 512 * 512, [&] {
+		source.scaled(out, false);
+		return (uint64_t)out.data()[0].r;
+	});
+}
+
+// Per pixel of the mipmapped texture, with few and with many colors
+void benchPalette() {
+	const int SIZE = 256;
+	std::mt19937 random(3);
+	std::vector<RGBA> few = randomPixels(16, 4);
+	Image flat(SIZE, SIZE);
+	for (int i=0; i<SIZE*SIZE; i++)
+		flat.data()[i] = few[random() % few.size()];
+
+	const std::pair<std::string, Image> inputs[] = {
+		{ "palette/16 colors 256", flat },
+		{ "palette/random 256", randomImage(SIZE, SIZE, 5) },
+	};
+	for (const auto& input : inputs) {
+		ImageContainer images;
+		images.loadImages({ input.second }, FLAG_MIPMAPPED | (PIXELFORMAT_PAL8BPP << PIXELFORMAT_SHIFT), NEAREST);
+		int64_t pixels = 0;
+		for (int i=0; i<images.imageCount(); i++)
+			pixels += (int64_t)images.getByIndex(i).width() * images.getByIndex(i).height();
+		run(input.first, pixels, [&] {
+			Palette palette(images);
+			return (uint64_t)palette.colorCount();
+		});
+	}
+}
+
+void printUsage() {
+	std::cout << "Usage: texmicrobench [--filter text] [--repetitions n] [--warmup ms]\n";
+}
+
+bool parseOptions(int argc, char* argv[]) {
+	for (int i=1; i<argc; i++) {
+		std::string arg = argv[i];
+		if (i+1 >= argc) {
+			printUsage();
+			return false;
+		}
+		std::string value = argv[++i];
+		if (arg == "--filter") {
+			opts.filter = value;
+		} else if (arg == "--repetitions") {
+			opts.repetitions = std::max(1, std::atoi(value.c_str()));
+		} else if (arg == "--warmup") {
+			opts.warmupMs = std::max(0.0, std::atof(value.c_str()));
+		} else {
+			printUsage();
+			return false;
+		}
+	}
+	return true;
+}
+
+}
+
+int main(int argc, char* argv[]) {
+	if (!parseOptions(argc, argv))
+		return 1;
+	g_verbose = false;
+
+	std::printf("%-32s %9s %10s %10s %10s %10s %10s\n",
+				"kernel", "items", "min ns", "p50 ns", "p90 ns", "p99 ns", "M/s p50");
+	benchTwiddler();
+	benchFindClosest<4>();
+	benchFindClosest<12>();
+	benchFindClosest<16>();
+	benchFindClosest<32>();
+	benchFindClosest<64>();
+	benchPixelFormats();
+	benchScaling();
+	benchPalette();
+	return 0;
+}
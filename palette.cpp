@@ -1,17 +1,106 @@
 #include "palette.h"
 #include "imagecontainer.h"
+#include "stats.h"
+#include "log.h"
 
 #include <fstream>
-#include <iostream>
 #include <cstring>
+#include <climits>
 
 Palette::Palette(const ImageContainer& images) {
-	for (int i=0;i<images.imageCount();i++) {
-		const Image& img=images.getByIndex(i);
-		for (int y=0;y<img.height();y++)
-			for (int x=0;x<img.width();x++)
-				insert(packColor(img.pixel(x,y)));
+	census(images, INT_MAX);
+}
+
+// Small open addressing hash table mapping packed ARGB colors to palette
+// indices. A lot cheaper per pixel than std::unordered_map, and the table
+// for 256 colors fits in L1.
+namespace {
+class ColorTable {
+public:
+	explicit ColorTable(int expected) {
+		int capacity = 64;
+		while (capacity < expected * 2 && capacity < (1 << 24)) capacity *= 2;
+		resize(capacity);
+	}
+
+	// Returns the index of 'color', or -1 after inserting it with 'index'.
+	int findOrInsert(uint32_t color, int index) {
+		uint32_t slot = hash(color);
+		while (values[slot] >= 0) {
+			if (keys[slot] == color) return values[slot];
+			slot = (slot + 1) & mask;
+		}
+		keys[slot] = color;
+		values[slot] = index;
+		if (++count * 2 > (int)keys.size()) resize((int)keys.size() * 2);
+		return -1;
+	}
+
+private:
+	uint32_t hash(uint32_t color) const { return (color * 0x9E3779B1u) >> shift; }
+
+	void resize(int capacity) {
+		std::vector<uint32_t> oldKeys;
+		std::vector<int> oldValues;
+		oldKeys.swap(keys);
+		oldValues.swap(values);
+		keys.assign(capacity, 0);
+		values.assign(capacity, -1);
+		mask = capacity - 1;
+		shift = 32;
+		for (int c = capacity; c > 1; c >>= 1) shift--;
+		count = 0;
+		for (size_t i = 0; i < oldKeys.size(); i++)
+			if (oldValues[i] >= 0) findOrInsert(oldKeys[i], oldValues[i]);
+	}
+
+	std::vector<uint32_t> keys;
+	std::vector<int> values;
+	uint32_t mask = 0;
+	int shift = 32;
+	int count = 0;
+};
+}
+
+bool Palette::census(const ImageContainer& images, int maxColors, std::vector<IndexedImage>* indexedImages) {
+	StatsTimer timer(PHASE_CENSUS);
+	clear();
+	if (indexedImages) indexedImages->clear();
+
+	ColorTable table(std::min(maxColors, 1 << 16));
+	uint32_t lastColor = 0;
+	int lastIndex = -1;
+
+	for (int i=0; i<images.imageCount(); i++) {
+		const Image& img = images.getByIndex(i);
+		IndexedImage indexed;
+		if (indexedImages)
+			indexed = IndexedImage(img.width(), img.height());
+
+		for (int y=0; y<img.height(); y++) {
+			uint8_t* row = indexedImages ? indexed.row(y) : nullptr;
+			for (int x=0; x<img.width(); x++) {
+				const uint32_t color = packColor(img.pixel(x, y));
+
+				// Neighboring pixels very often share a color
+				if (color != lastColor || lastIndex < 0) {
+					int index = table.findOrInsert(color, colorCount());
+					if (index < 0) {
+						if (colorCount() >= maxColors) return false;
+						index = colorCount();
+						insert(color);
+					}
+					lastColor = color;
+					lastIndex = index;
+				}
+
+				if (row) row[x] = (uint8_t)lastIndex;
+			}
+		}
+
+		if (indexedImages) indexedImages->push_back(std::move(indexed));
 	}
+	return true;
 }
 
 void Palette::insert(uint32_t color) {
@@ -22,6 +111,12 @@ void Palette::insert(uint32_t color) {
 	}
 }
 
+void Palette::append(uint32_t color) {
+	if (colorsMap.find(color)==colorsMap.end())
+		colorsMap[color]=(int)colorsVec.size();
+	colorsVec.push_back(color);
+}
+
 int Palette::indexOf(uint32_t argb) const {
 	auto it=colorsMap.find(argb);
 	return (it!=colorsMap.end()) ? it->second : 0;
@@ -33,46 +128,83 @@ uint32_t Palette::colorAt(int index) const {
 	return 0xFF000000; 
 }
 
-bool Palette::save(const std::string& filename) const {
+// Texture pixel format matching a 16-bit palette format, for to16BPP/to32BPP
+static int pixelFormatOf(int paletteFormat) {
+	switch (paletteFormat) {
+	case PALETTE_FORMAT_ARGB1555: return PIXELFORMAT_ARGB1555;
+	case PALETTE_FORMAT_RGB565:   return PIXELFORMAT_RGB565;
+	case PALETTE_FORMAT_ARGB4444: return PIXELFORMAT_ARGB4444;
+	default: return -1;
+	}
+}
+
+bool Palette::save(const std::string& filename, int format) const {
 	std::ofstream out(filename,std::ios::binary);
 	if (!out.is_open()) {
-		std::cerr<<"[ERROR] Failed to open "<<filename<<" for writing\n";
+		logError("Failed to open "+filename+" for writing");
 		return false;
 	}
 
 	
-	out.write(TEXTURE_MAGIC,4); 
-	int32_t n=colorCount();
-	out.write((char*)&n,sizeof(int32_t));
+	out.write(PALETTE_MAGIC,4); 
+	int16_t n=(int16_t)colorCount();
+	int16_t f=(int16_t)format;
+	out.write((char*)&n,sizeof(int16_t));
+	out.write((char*)&f,sizeof(int16_t));
 
-	
-	for (uint32_t c:colorsVec)
-		out.write((char*)&c,sizeof(uint32_t));
+	// Palette RAM entries are 32 bits wide in every mode, with 16-bit colors
+	// in the low half, so entries are always written as 32-bit words.
+	const int pixelFormat=pixelFormatOf(format);
+	for (uint32_t c:colorsVec) {
+		uint32_t entry=(pixelFormat<0) ? c : to16BPP(unpackColor(c),pixelFormat);
+		out.write((char*)&entry,sizeof(uint32_t));
+	}
 
 	out.close();
 	return true;
 }
 
+void Palette::quantize(int format) {
+	const int pixelFormat=pixelFormatOf(format);
+	if (pixelFormat<0) return;
+	std::vector<uint32_t> colors;
+	colors.swap(colorsVec);
+	colorsMap.clear();
+	for (uint32_t c:colors)
+		insert(packColor(to32BPP(to16BPP(unpackColor(c),pixelFormat),pixelFormat)));
+}
+
 bool Palette::load(const std::string& filename) {
 	std::ifstream in(filename,std::ios::binary);
 	if (!in.is_open()) {
-		std::cerr<<"[ERROR] Failed to open "<<filename<<" for reading\n";
+		logError("Failed to open "+filename+" for reading");
 		return false;
 	}
 	char magic[4];
 	in.read(magic,4);
-	if (memcmp(magic,PALETTE_MAGIC,4)!=0) {
-		std::cerr<<"[ERROR] "<<filename<<" is not a valid palette file\n";
+	int32_t numColors=0;
+	int16_t format=PALETTE_FORMAT_ARGB8888;
+	if (memcmp(magic,PALETTE_MAGIC,4)==0) {
+		int16_t n=0;
+		in.read((char*)&n,sizeof(int16_t));
+		in.read((char*)&format,sizeof(int16_t));
+		numColors=n;
+	} else if (memcmp(magic,TEXTURE_MAGIC,4)==0) {
+		// Older versions wrote the texture magic, a 32-bit count and
+		// ARGB8888 entries
+		in.read((char*)&numColors,sizeof(int32_t));
+	} else {
+		logError(filename+" is not a valid palette file");
 		return false;
 	}
-	int32_t numColors=0;
-	in.read((char*)&numColors,sizeof(int32_t));
 
+	// Colors are always kept as ARGB8888 in memory
+	const int pixelFormat=pixelFormatOf(format);
 	clear();
 	for (int i=0;i<numColors;i++) {
 		uint32_t c;
 		in.read((char*)&c,sizeof(uint32_t));
-		insert(c);
+		append((pixelFormat<0) ? c : packColor(to32BPP((uint16_t)c,pixelFormat)));
 	}
 	return true;
 }
\ No newline at end of file
@@ -5,6 +5,8 @@
 #include <string>
 #include <cstdint>
 #include "common.h"
+#include "image.h"
+#include "indexedimage.h"
 
 class ImageContainer;
 
@@ -17,12 +19,27 @@ public:
 	void clear() { colorsMap.clear(); colorsVec.clear(); }
 
 	void insert(uint32_t argb);
+	// Adds the color even if it's already in the palette. indexOf() keeps
+	// returning the first occurrence.
+	void append(uint32_t argb);
+
+	// Collects the unique colors of all images. Returns false as soon as more
+	// than maxColors colors are found, leaving the palette incomplete.
+	// On success, indexedImages (if given) receives one indexed image per
+	// level, smallest first, produced in the same pass.
+	bool census(const ImageContainer& images, int maxColors, std::vector<IndexedImage>* indexedImages = nullptr);
 
 	int indexOf(uint32_t argb) const;
+	bool contains(uint32_t argb) const { return colorsMap.find(argb) != colorsMap.end(); }
 	uint32_t colorAt(int index) const;
 
 	bool load(const std::string& filename);
-	bool save(const std::string& filename) const;
+	bool save(const std::string& filename, int format = PALETTE_FORMAT_ARGB8888) const;
+
+	// Rounds every color to what a palette file in 'format' holds, so the
+	// palette matches what save() and load() give. Colors that become equal
+	// are merged, so indices into the palette have to be mapped again.
+	void quantize(int format);
 
 private:
 	std::unordered_map<uint32_t,int> colorsMap;
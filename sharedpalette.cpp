@@ -0,0 +1,134 @@
+#include "sharedpalette.h"
+#include "common.h"
+#include "log.h"
+
+#include <algorithm>
+
+// Number of colors of 'pal' that aren't in 'bank' yet
+static int missingColors(const Palette& bank, const Palette& pal) {
+	int missing = 0;
+	for (int i=0; i<pal.colorCount(); i++)
+		if (!bank.contains(pal.colorAt(i)))
+			missing++;
+	return missing;
+}
+
+// First fit decreasing: place each texture in the bank that needs the fewest
+// new colors for it, or open a new bank if none has room.
+static void packBanks(std::vector<SharedPaletteTexture*>& textures, int bankSize, std::vector<Palette>& banks) {
+	std::stable_sort(textures.begin(), textures.end(),
+					 [](const SharedPaletteTexture* a, const SharedPaletteTexture* b) {
+						 return a->palette.colorCount() > b->palette.colorCount();
+					 });
+
+	for (auto* texture : textures) {
+		int best = -1;
+		int bestMissing = bankSize + 1;
+		for (size_t i=0; i<banks.size(); i++) {
+			const int missing = missingColors(banks[i], texture->palette);
+			if (banks[i].colorCount() + missing <= bankSize && missing < bestMissing) {
+				best = (int)i;
+				bestMissing = missing;
+			}
+		}
+		if (best < 0) {
+			best = (int)banks.size();
+			banks.push_back(Palette());
+		}
+		for (int i=0; i<texture->palette.colorCount(); i++)
+			banks[best].insert(texture->palette.colorAt(i));
+		texture->bank = best;
+	}
+}
+
+// Puts the textures into 'count' groups by the bank packBanks gave them, so
+// textures that share a bank stay together, and quantizes each group to a
+// single bank from all of its pixels.
+static void mergeBanks(std::vector<SharedPaletteTexture*>& textures, int bankSize, int count, std::vector<Palette>& banks) {
+	std::vector<std::vector<const ImageContainer*>> groups(count);
+	for (auto* texture : textures) {
+		texture->bank %= count;
+		groups[texture->bank].push_back(texture->images);
+	}
+
+	banks.assign(count, Palette());
+	for (int i=0; i<count; i++)
+		reduceColors(groups[i], bankSize, banks[i]);
+
+	for (auto* texture : textures) {
+		texture->palette = banks[texture->bank];
+		mapToPalette(*texture->images, texture->palette, texture->indexedImages);
+	}
+}
+
+// Points the indexed images of the texture at the colors of its bank
+static void remapToBank(SharedPaletteTexture& texture, const Palette& bank) {
+	uint8_t lut[256] = { 0 };
+	for (int i=0; i<texture.palette.colorCount(); i++)
+		lut[i] = (uint8_t)bank.indexOf(texture.palette.colorAt(i));
+
+	for (auto& img : texture.indexedImages) {
+		for (int y=0; y<img.height(); y++) {
+			uint8_t* row = img.row(y);
+			for (int x=0; x<img.width(); x++)
+				row[x] = lut[row[x]];
+		}
+	}
+	texture.palette = bank;
+}
+
+bool buildSharedPalette(std::vector<SharedPaletteTexture*>& textures, Palette& shared) {
+	std::vector<SharedPaletteTexture*> pal8, pal4;
+	for (auto* texture : textures) {
+		if (isFormat(texture->textureType, PIXELFORMAT_PAL8BPP))
+			pal8.push_back(texture);
+		else
+			pal4.push_back(texture);
+	}
+
+	std::vector<Palette> banks8, banks4;
+	packBanks(pal8, 256, banks8);
+	packBanks(pal4, 16, banks4);
+
+	// Too many colors to share exactly. The 16 color banks are small, so they
+	// get the room they need first, but at least one 256 color bank is kept.
+	if ((int)banks8.size() * 256 + (int)banks4.size() * 16 > PALETTE_RAM_ENTRIES) {
+		const int keep8 = std::min((int)banks8.size(), std::max(1, (PALETTE_RAM_ENTRIES - (int)banks4.size() * 16) / 256));
+		const int keep4 = std::min((int)banks4.size(), (PALETTE_RAM_ENTRIES - keep8 * 256) / 16);
+		logInfo("Shared palette needs " + std::to_string(banks8.size()) + " 256 color banks and "
+				+ std::to_string(banks4.size()) + " 16 color banks, quantizing textures together to fit "
+				+ std::to_string(keep8) + " and " + std::to_string(keep4));
+		if (keep8 < (int)banks8.size())
+			mergeBanks(pal8, 256, keep8, banks8);
+		if (keep4 < (int)banks4.size() && keep4 > 0)
+			mergeBanks(pal4, 16, keep4, banks4);
+	}
+
+	const int entries = (int)banks8.size() * 256 + (int)banks4.size() * 16;
+	if (entries > PALETTE_RAM_ENTRIES) {
+		logError("Shared palette needs " + std::to_string(banks8.size()) + " 256 color banks and "
+				 + std::to_string(banks4.size()) + " 16 color banks, which don't fit in "
+				 + std::to_string(PALETTE_RAM_ENTRIES) + " palette entries");
+		return false;
+	}
+
+	// PAL4BPP banks follow the PAL8BPP ones, numbered in units of 16 entries
+	for (auto* texture : pal8)
+		remapToBank(*texture, banks8[texture->bank]);
+	for (auto* texture : pal4) {
+		remapToBank(*texture, banks4[texture->bank]);
+		texture->bank += (int)banks8.size() * 16;
+	}
+
+	shared.clear();
+	for (const auto& bank : banks8)
+		for (int i=0; i<256; i++)
+			shared.append(i < bank.colorCount() ? bank.colorAt(i) : 0);
+	for (const auto& bank : banks4)
+		for (int i=0; i<16; i++)
+			shared.append(i < bank.colorCount() ? bank.colorAt(i) : 0);
+
+	logInfo("Shared palette uses " + std::to_string(banks8.size()) + " 256 color banks and "
+			+ std::to_string(banks4.size()) + " 16 color banks");
+	return true;
+}
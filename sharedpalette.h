@@ -0,0 +1,28 @@
+#pragma once
+
+#include <vector>
+#include "indexedimage.h"
+#include "palette.h"
+
+class ImageContainer;
+
+#define PALETTE_RAM_ENTRIES 1024
+
+// A paletted texture taking part in a shared palette.
+struct SharedPaletteTexture {
+	int textureType = 0;
+	const ImageContainer* images = nullptr;		// For quantizing textures together
+	Palette palette;							// In: the texture's own colors. Out: its bank's colors
+	std::vector<IndexedImage> indexedImages;	// Remapped to index into the bank
+	int bank = -1;								// Palette bank, in units of 16 (PAL4BPP) or 256 (PAL8BPP) entries
+};
+
+// Packs the palettes of all textures into as few 16 or 256 entry banks of
+// the palette RAM as possible, letting textures share a bank when their
+// combined colors fit. If that needs more banks than the palette RAM holds,
+// textures that would have had separate banks are grouped together, and
+// each group gets one bank quantized from the pixels of all its textures.
+// PAL8BPP banks come first, followed by PAL4BPP banks. 'shared' receives
+// the contents of the whole palette RAM that's in use. Returns false if the
+// banks don't fit in the palette RAM.
+bool buildSharedPalette(std::vector<SharedPaletteTexture*>& textures, Palette& shared);
@@ -0,0 +1,46 @@
+#include <iomanip>
+#include <sstream>
+#include "stats.h"
+
+Stats* g_stats = nullptr;
+
+static const char* const phaseNames[PHASE_COUNT] = {
+	"total", "load", "mipmaps", "census", "median_cut", "lossless", "vq_seed", "vq_split",
+	"vq_repair", "vq_refine", "indexing", "twiddle", "preview", "metrics", "write"
+};
+
+static const char* const counterNames[COUNTER_COUNT] = {
+	"unique_vectors", "distance_evaluations", "place_passes", "bytes_written"
+};
+
+const char* phaseName(StatsPhase phase) {
+	return phaseNames[phase];
+}
+
+Stats::Stats() {
+	for (auto& t : times) t = 0;
+	for (auto& c : calls) c = 0;
+	for (auto& c : counters) c = 0;
+}
+
+void Stats::addTime(StatsPhase phase, int64_t nanoseconds) {
+	times[phase] += nanoseconds;
+	calls[phase]++;
+}
+
+void Stats::writeJson(std::ostream& stream) const {
+	stream << "{\"phases\": {";
+	bool first = true;
+	for (int i=0; i<PHASE_COUNT; i++) {
+		if (calls[i] == 0) continue;
+		std::ostringstream ms;
+		ms << std::fixed << std::setprecision(3) << times[i] / 1e6;
+		stream << (first ? "" : ", ") << "\"" << phaseNames[i] << "\": {\"ms\": " << ms.str()
+			   << ", \"calls\": " << calls[i] << "}";
+		first = false;
+	}
+	stream << "}, \"counters\": {";
+	for (int i=0; i<COUNTER_COUNT; i++)
+		stream << (i ? ", " : "") << "\"" << counterNames[i] << "\": " << counters[i];
+	stream << "}}";
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+
+#include "trace.h"
+
+// Parts of a conversion that get timed
+enum StatsPhase {
+	PHASE_TOTAL,		// Loading and converting the texture, start to end
+	PHASE_LOAD,			// Decoding (and resizing) the input images
+	PHASE_MIPMAPS,		// Generating missing mipmap levels
+	PHASE_CENSUS,		// Counting the colors for a palette
+	PHASE_MEDIAN_CUT,	// Building a palette with median cut
+	PHASE_LOSSLESS,		// Looking for few enough unique 2x2 blocks
+	PHASE_VQ_SEED,		// k-means++ seeding of the codebook
+	PHASE_VQ_SPLIT,		// Splitting every code in two
+	PHASE_VQ_REPAIR,	// Splitting the worst codes to fill the codebook
+	PHASE_VQ_REFINE,	// place() passes moving codes to their centroids
+	PHASE_INDEXING,		// Finding the closest code or color for every block or pixel
+	PHASE_TWIDDLE,		// Putting the texture data in its final order
+	PHASE_PREVIEW,		// Decoding and saving previews
+	PHASE_METRICS,		// Decoding and measuring the quality
+	PHASE_WRITE,		// Writing the texture file
+	PHASE_COUNT
+};
+
+enum StatsCounter {
+	COUNTER_UNIQUE_VECTORS,		// Distinct vectors given to vector quantizers
+	COUNTER_DISTANCES,			// Distances computed while searching for the closest code
+	COUNTER_PLACE_PASSES,		// Calls of VectorQuantizer::place()
+	COUNTER_BYTES_WRITTEN,		// Size of the texture file
+	COUNTER_COUNT
+};
+
+// The name of a phase in --stats and --trace output
+const char* phaseName(StatsPhase phase);
+
+// Time spent in each phase and counts of expensive operations for one
+// texture. Can be updated from several threads at once; phases that run on
+// several threads add up their time.
+class Stats {
+public:
+	Stats();
+
+	void addTime(StatsPhase phase, int64_t nanoseconds);
+	void add(StatsCounter counter, int64_t amount) { counters[counter] += amount; }
+
+	// Writes one JSON object with "phases" (milliseconds and calls) and "counters"
+	void writeJson(std::ostream& stream) const;
+
+private:
+	std::atomic<int64_t> times[PHASE_COUNT];
+	std::atomic<int64_t> calls[PHASE_COUNT];
+	std::atomic<int64_t> counters[COUNTER_COUNT];
+};
+
+// The stats of the texture being converted, null when they're not wanted.
+// Only changed while no conversion work is running.
+extern Stats* g_stats;
+
+inline void countStat(StatsCounter counter, int64_t amount) {
+	if (g_stats) g_stats->add(counter, amount);
+}
+
+// Adds the time until it goes out of scope to a phase of g_stats, and
+// records it as a trace event when tracing. Doesn't even read the clock
+// when neither is on.
+class StatsTimer {
+public:
+	explicit StatsTimer(StatsPhase phase) : stats(g_stats), phase(phase) {
+		if (stats || g_tracing) start = std::chrono::steady_clock::now();
+	}
+	~StatsTimer() {
+		if (!stats && !g_tracing) return;
+		auto end = std::chrono::steady_clock::now();
+		if (stats) stats->addTime(phase, std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+		if (g_tracing) traceEvent(phaseName(phase), "phase", start, end);
+	}
+
+	StatsTimer(const StatsTimer&) = delete;
+	StatsTimer& operator=(const StatsTimer&) = delete;
+
+private:
+	Stats* stats;
+	StatsPhase phase;
+	std::chrono::steady_clock::time_point start;
+};
@@ -1,32 +1,22 @@
-#include <iostream>
 #include <fstream>
 #include <unordered_map>
 #include <vector>
 #include <string>
 #include <algorithm>
+#include <sstream>
+#include <memory>
+#include <iomanip>
+#include <cmath>
 
 #include "common.h"
 #include "imagecontainer.h"
-
-static bool g_verbose = false;
-
-#define REDCOLOR	   "\033[31m"
-#define YELLOWCOLOR     "\033[33m"
-#define NOCOLOR	        "\033[0m"
-
-inline void logDebug(const std::string& msg) {
-	if (g_verbose) std::cout << msg << std::endl;
-}
-inline void logWarning(const std::string& msg) {
-	std::cerr << YELLOWCOLOR << "[WARNING] " << msg << NOCOLOR << std::endl;
-}
-inline void logError(const std::string& msg) {
-	std::cerr << REDCOLOR << "[ERROR] " << msg << NOCOLOR << std::endl;
-}
-inline void logFatal(const std::string& msg) {
-	std::cerr << REDCOLOR << "[FATAL] " << msg << NOCOLOR << std::endl;
-	exit(1);
-}
+#include "palette.h"
+#include "sharedpalette.h"
+#include "threadpool.h"
+#include "metrics.h"
+#include "autoformat.h"
+#include "stats.h"
+#include "log.h"
 
 struct CommandLineOptions {
 	std::vector<std::string> inputs;
@@ -34,6 +24,24 @@ struct CommandLineOptions {
 	std::string format;
 	std::string preview;
 	std::string codeUsage;
+	std::string batch;
+	std::string sharedPalette;
+	std::string vqInit;
+	std::string vqSplit;
+	std::string paletteQuantizer;
+	std::string paletteFormat;
+	int kmeansPolish = 0;
+	uint32_t vqSeed = 0;
+	int vqSample = 0;
+	int vqTimeBudget = 0;
+	int threads = 0;
+	bool fastPreview = false;
+	bool metrics = false;
+	bool ssim = false;
+	std::string metricsJson;
+	double minPSNR = 35;
+	std::string stats;
+	std::string trace;
 
 	bool mipmap	 = false;
 	bool compress   = false;
@@ -41,8 +49,45 @@ struct CommandLineOptions {
 	bool verbose	= false;
 	bool nearest	= false;
 	bool bilinear   = false;
+	std::string mipFilter;
+	std::string resize;
 };
 
+// Parse the numeric value of an option, logging an error naming the option
+// if it isn't a number
+bool parseNumber(const std::string& option, const std::string& value, int& out) {
+	try {
+		size_t end;
+		out = std::stoi(value, &end);
+		if (end == value.size()) return true;
+	} catch (const std::exception&) {}
+	logError("Invalid value for " + option + ": " + value);
+	return false;
+}
+
+bool parseNumber(const std::string& option, const std::string& value, uint32_t& out) {
+	try {
+		size_t end;
+		unsigned long v = std::stoul(value, &end);
+		if (end == value.size() && v <= 0xFFFFFFFFul && value.find('-') == std::string::npos) {
+			out = (uint32_t)v;
+			return true;
+		}
+	} catch (const std::exception&) {}
+	logError("Invalid value for " + option + ": " + value);
+	return false;
+}
+
+bool parseNumber(const std::string& option, const std::string& value, double& out) {
+	try {
+		size_t end;
+		out = std::stod(value, &end);
+		if (end == value.size()) return true;
+	} catch (const std::exception&) {}
+	logError("Invalid value for " + option + ": " + value);
+	return false;
+}
+
 bool parseArgs(int argc, char** argv, CommandLineOptions& opts) {
 	for (int i=1; i<argc; i++) {
 		std::string arg = argv[i];
@@ -54,8 +99,44 @@ bool parseArgs(int argc, char** argv, CommandLineOptions& opts) {
 			opts.format = argv[++i];
 		} else if ((arg=="-p"||arg=="--preview") && i+1<argc) {
 			opts.preview = argv[++i];
+		} else if (arg=="--batch" && i+1<argc) {
+			opts.batch = argv[++i];
+		} else if (arg=="--shared-palette" && i+1<argc) {
+			opts.sharedPalette = argv[++i];
 		} else if (arg=="--vqcodeusage" && i+1<argc) {
 			opts.codeUsage = argv[++i];
+		} else if (arg=="--vq-init" && i+1<argc) {
+			opts.vqInit = argv[++i];
+		} else if (arg=="--vq-split" && i+1<argc) {
+			opts.vqSplit = argv[++i];
+		} else if (arg=="--vq-seed" && i+1<argc) {
+			if (!parseNumber(arg, argv[++i], opts.vqSeed)) return false;
+		} else if (arg=="--vq-sample" && i+1<argc) {
+			if (!parseNumber(arg, argv[++i], opts.vqSample)) return false;
+		} else if (arg=="--vq-time-budget" && i+1<argc) {
+			if (!parseNumber(arg, argv[++i], opts.vqTimeBudget)) return false;
+		} else if (arg=="--fast-preview") {
+			opts.fastPreview = true;
+		} else if (arg=="--metrics") {
+			opts.metrics = true;
+		} else if (arg=="--metrics-json" && i+1<argc) {
+			opts.metricsJson = argv[++i];
+		} else if (arg=="--min-psnr" && i+1<argc) {
+			if (!parseNumber(arg, argv[++i], opts.minPSNR)) return false;
+		} else if (arg=="--stats" && i+1<argc) {
+			opts.stats = argv[++i];
+		} else if (arg=="--trace" && i+1<argc) {
+			opts.trace = argv[++i];
+		} else if (arg=="--ssim") {
+			opts.ssim = true;
+		} else if (arg=="--threads" && i+1<argc) {
+			if (!parseNumber(arg, argv[++i], opts.threads)) return false;
+		} else if (arg=="--palette-quantizer" && i+1<argc) {
+			opts.paletteQuantizer = argv[++i];
+		} else if (arg=="--palette-format" && i+1<argc) {
+			opts.paletteFormat = argv[++i];
+		} else if (arg=="--kmeans-polish" && i+1<argc) {
+			if (!parseNumber(arg, argv[++i], opts.kmeansPolish)) return false;
 		} else if (arg=="-m"||arg=="--mipmap") {
 			opts.mipmap = true;
 		} else if (arg=="-c"||arg=="--compress") {
@@ -68,6 +149,10 @@ bool parseArgs(int argc, char** argv, CommandLineOptions& opts) {
 			opts.nearest = true;
 		} else if (arg=="-b"||arg=="--bilinear") {
 			opts.bilinear = true;
+		} else if (arg=="--mipfilter" && i+1<argc) {
+			opts.mipFilter = argv[++i];
+		} else if (arg=="--resize" && i+1<argc) {
+			opts.resize = argv[++i];
 		} else {
 			logError("Unknown option: " + arg);
 			return false;
@@ -76,36 +161,152 @@ bool parseArgs(int argc, char** argv, CommandLineOptions& opts) {
 	return true;
 }
 
-int main(int argc, char** argv) {
-	CommandLineOptions opts;
-	if (!parseArgs(argc, argv, opts)) {
-		return -1;
+// Parses one line of a batch file. Options not given on the line are
+// inherited from 'defaults', except for the input and output files. Options
+// that apply to the whole run are only allowed on the command line.
+bool parseBatchLine(const std::string& line, const CommandLineOptions& defaults, CommandLineOptions& opts) {
+	static const char* runOptions[] = { "--batch", "--shared-palette", "--threads", "--stats", "--trace", "--metrics-json" };
+	std::vector<std::string> tokens;
+	std::istringstream stream(line);
+	std::string token;
+	while (stream >> token) {
+		for (const char* option : runOptions) {
+			if (token == option) {
+				logError("Option " + token + " can only be given on the command line, not in a batch file");
+				return false;
+			}
+		}
+		tokens.push_back(token);
 	}
-	g_verbose = opts.verbose;
 
-	std::unordered_map<std::string,int> supportedFormats = {
-		{"ARGB1555", PIXELFORMAT_ARGB1555},
-		{"RGB565"  , PIXELFORMAT_RGB565},
-		{"ARGB4444", PIXELFORMAT_ARGB4444},
-		{"YUV422"  , PIXELFORMAT_YUV422},
-		{"BUMPMAP" , PIXELFORMAT_BUMPMAP},
-		{"PAL4BPP" , PIXELFORMAT_PAL4BPP},
-		{"PAL8BPP" , PIXELFORMAT_PAL8BPP}
+	std::vector<char*> argv;
+	static char program[] = "texconv";
+	argv.push_back(program);
+	for (auto& t : tokens) argv.push_back(&t[0]);
+
+	opts = defaults;
+	opts.inputs.clear();
+	opts.output.clear();
+	opts.preview.clear();
+	opts.codeUsage.clear();
+	return parseArgs((int)argv.size(), argv.data(), opts);
+}
+
+// Options of a job that the converters read from globals. Jobs are worked
+// on one at a time, and each sets these before its work, like g_stats.
+struct JobSettings {
+	VQOptions vq;
+	PaletteOptions palette;
+	bool fastPreview = false;
+	bool verbose = false;
+};
+
+// Validates the VQ, palette and preview options of a job
+bool parseJobSettings(const CommandLineOptions& opts, JobSettings& settings) {
+	if (opts.vqInit.empty() || opts.vqInit == "lbg") {
+		settings.vq.initMode = VQ_INIT_SPLIT;
+	} else if (opts.vqInit == "kmeans++") {
+		settings.vq.initMode = VQ_INIT_KMEANSPP;
+	} else {
+		logError("Unsupported VQ init mode: " + opts.vqInit);
+		return false;
+	}
+	if (opts.vqSplit.empty() || opts.vqSplit == "perturb") {
+		settings.vq.splitMode = VQ_SPLIT_PERTURB;
+	} else if (opts.vqSplit == "principal") {
+		settings.vq.splitMode = VQ_SPLIT_PRINCIPAL;
+	} else {
+		logError("Unsupported VQ split mode: " + opts.vqSplit);
+		return false;
+	}
+	settings.vq.seed = opts.vqSeed;
+	settings.vq.maxTrainingVectors = std::max(0, opts.vqSample);
+	settings.vq.timeBudgetMs = std::max(0, opts.vqTimeBudget);
+
+	if (opts.paletteQuantizer.empty() || opts.paletteQuantizer == "vq") {
+		settings.palette.quantizer = PALETTE_QUANTIZER_VQ;
+	} else if (opts.paletteQuantizer == "mediancut") {
+		settings.palette.quantizer = PALETTE_QUANTIZER_MEDIANCUT;
+	} else {
+		logError("Unsupported palette quantizer: " + opts.paletteQuantizer);
+		return false;
+	}
+	settings.palette.kmeansPasses = std::max(0, opts.kmeansPolish);
+
+	static const std::unordered_map<std::string,int> paletteFormats = {
+		{"ARGB8888", PALETTE_FORMAT_ARGB8888},
+		{"ARGB1555", PALETTE_FORMAT_ARGB1555},
+		{"RGB565"  , PALETTE_FORMAT_RGB565},
+		{"ARGB4444", PALETTE_FORMAT_ARGB4444}
 	};
+	if (!opts.paletteFormat.empty()) {
+		auto it = paletteFormats.find(opts.paletteFormat);
+		if (it == paletteFormats.end()) {
+			logError("Unsupported palette format: " + opts.paletteFormat);
+			return false;
+		}
+		settings.palette.format = it->second;
+	}
+
+	settings.fastPreview = opts.fastPreview;
+	settings.verbose = opts.verbose;
+	return true;
+}
+
+void applyJobSettings(const JobSettings& settings) {
+	g_vqOptions = settings.vq;
+	g_paletteOptions = settings.palette;
+	g_fastPreview = settings.fastPreview;
+	g_verbose = settings.verbose;
+}
+
+// One texture to convert
+struct TextureJob {
+	CommandLineOptions opts;
+	JobSettings settings;
+	int textureType = 0;
+	ImageContainer images;
+	SharedPaletteTexture shared;	// Only used with --shared-palette
+	std::vector<LevelMetrics> metrics;	// Only filled in with --metrics or --metrics-json
+	AutoFormat autoFormat;				// Only used with --format auto
+	std::unique_ptr<Stats> stats;		// Only used with --stats
+};
+
+static const std::unordered_map<std::string,int> supportedFormats = {
+	{"ARGB1555", PIXELFORMAT_ARGB1555},
+	{"RGB565"  , PIXELFORMAT_RGB565},
+	{"ARGB4444", PIXELFORMAT_ARGB4444},
+	{"YUV422"  , PIXELFORMAT_YUV422},
+	{"BUMPMAP" , PIXELFORMAT_BUMPMAP},
+	{"PAL4BPP" , PIXELFORMAT_PAL4BPP},
+	{"PAL8BPP" , PIXELFORMAT_PAL8BPP}
+};
+
+static std::string formatName(int textureType) {
+	const int pixelFormat = (textureType >> PIXELFORMAT_SHIFT) & PIXELFORMAT_MASK;
+	for (const auto& kv : supportedFormats)
+		if (kv.second == pixelFormat) return kv.first;
+	return "unknown";
+}
+
+// Validates the options of a job and loads its images
+bool prepareJob(TextureJob& job) {
+	const CommandLineOptions& opts = job.opts;
 
 	if (opts.inputs.empty()) {
 		logError("No input file(s) specified");
-		return -1;
+		return false;
 	}
 	if (opts.output.empty()) {
 		logError("No output file specified");
-		return -1;
+		return false;
 	}
 
-	std::string palFilename = opts.output + ".pal";
-
-	int pixelFormat = -1;
-	if (!opts.format.empty()) {
+	// Automatic format selection loads the images like for a 16-bit format,
+	// and picks the format once they are loaded.
+	const bool autoFormat = (opts.format == "auto");
+	int pixelFormat = autoFormat ? PIXELFORMAT_RGB565 : -1;
+	if (!autoFormat && !opts.format.empty()) {
 		auto it = supportedFormats.find(opts.format);
 		if (it != supportedFormats.end()) {
 			pixelFormat = it->second;
@@ -113,66 +314,402 @@ int main(int argc, char** argv) {
 	}
 	if (pixelFormat == -1) {
 		logError("Unsupported format: " + opts.format);
-		return -1;
+		return false;
 	}
 
 	int textureType = (pixelFormat << PIXELFORMAT_SHIFT);
 	if (opts.mipmap)   textureType |= FLAG_MIPMAPPED;
-	if (opts.compress) textureType |= FLAG_COMPRESSED;
+	if (opts.compress && !autoFormat) textureType |= FLAG_COMPRESSED;
 	if (opts.stride)   textureType |= (FLAG_STRIDED | FLAG_NONTWIDDLED);
 
-	FilterMode mipmapFilter = (isPaletted(textureType)) ? NEAREST : BILINEAR;
+	FilterMode mipmapFilter = (isPaletted(textureType)) ? NEAREST : BOX;
 	if (opts.nearest)  mipmapFilter = NEAREST;
 	if (opts.bilinear) mipmapFilter = BILINEAR;
+	if (!opts.mipFilter.empty()) {
+		static const std::unordered_map<std::string,FilterMode> filters = {
+			{"nearest" , NEAREST},
+			{"bilinear", BILINEAR},
+			{"box"     , BOX},
+			{"triangle", TRIANGLE},
+			{"lanczos" , LANCZOS}
+		};
+		auto it = filters.find(opts.mipFilter);
+		if (it == filters.end()) {
+			logError("Unsupported mipmap filter: " + opts.mipFilter);
+			return false;
+		}
+		mipmapFilter = it->second;
+	}
 
-	ImageContainer images;
-	if (!images.load(opts.inputs, textureType, mipmapFilter)) {
-		return -1;
+	ResizeMode resizeMode = RESIZE_NONE;
+	if (opts.resize == "fit") {
+		resizeMode = RESIZE_FIT;
+	} else if (opts.resize == "nearest-pow2") {
+		resizeMode = RESIZE_NEAREST_POW2;
+	} else if (!opts.resize.empty()) {
+		logError("Unsupported resize mode: " + opts.resize);
+		return false;
+	}
+
+	if (!job.images.load(opts.inputs, textureType, mipmapFilter, resizeMode)) {
+		return false;
 	}
 
 	if (textureType & FLAG_STRIDED) {
-		int strideSetting = images.width() / 32;
+		int strideSetting = job.images.width() / 32;
 		textureType |= strideSetting;
 	}
 
-	std::ofstream out(opts.output, std::ios::binary);
-	if (!out.is_open()) {
+	if (autoFormat) {
+		const int flags = textureType & ~(PIXELFORMAT_MASK << PIXELFORMAT_SHIFT);
+		if (!chooseFormat(job.images, flags, opts.minPSNR, job.autoFormat)) {
+			logError("No format can hold the images of " + opts.output);
+			return false;
+		}
+		textureType = job.autoFormat.textureType;
+
+		std::ostringstream msg;
+		msg << std::fixed << std::setprecision(2) << "Picked " << formatName(textureType)
+			<< ((textureType & FLAG_COMPRESSED) ? " compressed" : "") << " for " << opts.output
+			<< ": " << job.autoFormat.texture.size() << " bytes, PSNR " << job.autoFormat.psnr << " dB";
+		logInfo(msg.str());
+		if (job.autoFormat.psnr < opts.minPSNR) {
+			std::ostringstream warning;
+			warning << "No format reaches a PSNR of " << opts.minPSNR << " dB for " << opts.output;
+			logWarning(warning.str());
+		}
+	}
+
+	job.textureType = textureType;
+	job.shared.textureType = textureType;
+	return true;
+}
+
+// Prints the quality of every level of a texture, and of all levels together.
+static void printMetrics(const std::string& filename, const std::vector<LevelMetrics>& metrics, bool ssim) {
+	for (const auto& m : metrics) {
+		std::ostringstream line;
+		line << std::fixed << std::setprecision(2) << "Metrics of " << filename << " " << m.width << "x" << m.height
+			 << ": MSE " << m.mse << ", PSNR " << m.psnr << " dB";
+		if (ssim) line << ", SSIM " << std::setprecision(4) << m.ssim;
+		logInfo(line.str());
+	}
+	if (metrics.size() > 1) {
+		std::ostringstream line;
+		line << std::fixed << std::setprecision(2) << "Metrics of " << filename << " overall: PSNR " << overallPSNR(metrics) << " dB";
+		logInfo(line.str());
+	}
+}
+
+static std::string jsonString(const std::string& s) {
+	std::string out = "\"";
+	for (char c : s) {
+		if (c == '"' || c == '\\') out += '\\';
+		out += c;
+	}
+	return out + "\"";
+}
+
+// Writes the metrics of every measured job as a JSON array. PSNR of exact
+// levels is written as null, as JSON has no infinity.
+static bool saveMetricsJson(const std::vector<TextureJob>& jobs, const std::string& filename) {
+	std::ofstream file(filename);
+	if (!file.is_open()) {
+		logError("Failed to open file for writing: " + filename);
+		return false;
+	}
+
+	auto number = [](double v) {
+		if (std::isinf(v)) return std::string("null");
+		std::ostringstream s;
+		s << std::setprecision(6) << v;
+		return s.str();
+	};
+
+	file << "[\n";
+	bool first = true;
+	for (const auto& job : jobs) {
+		if (job.metrics.empty()) continue;
+		if (!first) file << ",\n";
+		first = false;
+		file << "  {\"texture\": " << jsonString(job.opts.output) << ", \"format\": " << jsonString(formatName(job.textureType))
+			 << ", \"compressed\": " << ((job.textureType & FLAG_COMPRESSED) ? "true" : "false")
+			 << ", \"psnr\": " << number(overallPSNR(job.metrics)) << ", \"levels\": [\n";
+		for (size_t i=0; i<job.metrics.size(); i++) {
+			const LevelMetrics& m = job.metrics[i];
+			file << "    {\"width\": " << m.width << ", \"height\": " << m.height
+				 << ", \"mse\": " << number(m.mse) << ", \"psnr\": " << number(m.psnr);
+			if (job.opts.ssim) file << ", \"ssim\": " << number(m.ssim);
+			file << "}" << (i+1 < job.metrics.size() ? "," : "") << "\n";
+		}
+		file << "  ]}";
+	}
+	file << "\n]\n";
+	return file.good();
+}
+
+// Writes the stats of every job as a JSON array
+static bool saveStatsJson(const std::vector<TextureJob>& jobs, const std::string& filename) {
+	std::ofstream file(filename);
+	if (!file.is_open()) {
+		logError("Failed to open file for writing: " + filename);
+		return false;
+	}
+
+	file << "[\n";
+	for (size_t i=0; i<jobs.size(); i++) {
+		const TextureJob& job = jobs[i];
+		file << "  {\"texture\": " << jsonString(job.opts.output) << ", \"format\": " << jsonString(formatName(job.textureType))
+			 << ", \"compressed\": " << ((job.textureType & FLAG_COMPRESSED) ? "true" : "false") << ", \"stats\": ";
+		job.stats->writeJson(file);
+		file << "}" << (i+1 < jobs.size() ? "," : "") << "\n";
+	}
+	file << "]\n";
+	return file.good();
+}
+
+// Converts and saves the texture of a job, plus its palette and previews.
+// Paletted textures use job.shared if sharedPalette is set.
+bool writeJob(TextureJob& job, bool sharedPalette) {
+	const CommandLineOptions& opts = job.opts;
+	const int textureType = job.textureType;
+	const ImageContainer& images = job.images;
+	std::string palFilename = opts.output + ".pal";
+
+	std::ofstream file(opts.output, std::ios::binary);
+	if (!file.is_open()) {
 		logError("Failed to open file for writing: " + opts.output);
+		return false;
+	}
+
+	// Build the texture in memory, so the previews can be made from it while
+	// it's being written to disk.
+	// With --format auto the texture usually exists already, unless it has
+	// to be redone with the shared palette.
+	std::string texture;
+	Palette palette;
+	if (!job.autoFormat.texture.empty() && !(isPaletted(textureType) && sharedPalette)) {
+		texture = std::move(job.autoFormat.texture);
+		palette = job.autoFormat.palette;
+		if (isPaletted(textureType))
+			palette.save(palFilename, g_paletteOptions.format);
+	} else {
+		std::ostringstream out;
+		int expectedSize = writeTextureHeader(out, images.width(), images.height(), textureType);
+		std::streampos positionBeforeData = out.tellp();
+
+		if (isPaletted(textureType) && sharedPalette) {
+			writePalettedData(out, textureType, job.shared.indexedImages, job.shared.palette);
+		} else if (isPaletted(textureType)) {
+			convertPaletted(out, images, textureType, palFilename, palette);
+		} else {
+			convert16BPP(out, images, textureType);
+		}
+
+		std::streampos positionAfterData = out.tellp();
+		int padding = expectedSize - (positionAfterData - positionBeforeData);
+		if (padding > 0) {
+			if (padding >= 32) logWarning("Padding is " + std::to_string(padding));
+			writeZeroes(out, padding);
+			logDebug("Added " + std::to_string(padding) + " bytes of padding");
+		}
+		texture = out.str();
+	}
+
+	bool written = false;
+	std::future<void> writing = ThreadPool::global().submit([&]() {
+		StatsTimer timer(PHASE_WRITE);
+		written = file.write(texture.data(), texture.size()).good();
+		file.close();
+	});
+
+	std::string previewFilename = opts.preview;
+	std::string codeUsageFilename = (textureType & FLAG_COMPRESSED) ? opts.codeUsage : "";
+	const Palette* previewPalette = nullptr;
+	if (isPaletted(textureType)) previewPalette = sharedPalette ? &job.shared.palette : &palette;
+
+	if (!previewFilename.empty() || !codeUsageFilename.empty()) {
+		if (generatePreview((const uint8_t*)texture.data(), texture.size(), previewPalette, previewFilename, codeUsageFilename)) {
+			if (!previewFilename.empty())  logInfo("Saved preview image " + previewFilename);
+			if (!codeUsageFilename.empty()) logInfo("Saved code usage image " + codeUsageFilename);
+		} else {
+			if (!previewFilename.empty())  logError("Failed to save preview image " + previewFilename);
+			if (!codeUsageFilename.empty()) logError("Failed to save code usage image " + codeUsageFilename);
+		}
+	}
+
+	if (opts.metrics || !opts.metricsJson.empty()) {
+		if (!measureTexture((const uint8_t*)texture.data(), texture.size(), previewPalette, images, opts.ssim, job.metrics)) {
+			logError("Failed to measure the quality of " + opts.output);
+		} else if (opts.metrics) {
+			printMetrics(opts.output, job.metrics, opts.ssim);
+		}
+	}
+
+	writing.get();
+	if (!written) {
+		logError("Failed to write " + opts.output);
+		return false;
+	}
+	logDebug("Saved texture " + opts.output);
+	countStat(COUNTER_BYTES_WRITTEN, (int64_t)texture.size());
+
+	return true;
+}
+
+// Frees the images and converted data of a written job, keeping what the
+// stats and metrics files need
+void releaseJob(TextureJob& job) {
+	job.images.unloadAll();
+	job.shared = SharedPaletteTexture();
+	job.autoFormat = AutoFormat();
+}
+
+// Builds one palette for all paletted jobs and saves it in the palette format
+// of 'settings', along with a list of the palette bank each texture uses.
+// Textures quantized together to fit use 'settings' for that.
+bool saveSharedPalette(std::vector<TextureJob>& jobs, const std::string& filename, const JobSettings& settings) {
+	const int paletteFormat = settings.palette.format;
+	std::vector<SharedPaletteTexture*> textures;
+	for (auto& job : jobs) {
+		if (!isPaletted(job.textureType)) continue;
+		applyJobSettings(job.settings);
+		g_paletteOptions.format = paletteFormat;	// Colors are rounded to what the shared palette holds
+		g_stats = job.stats.get();
+		StatsTimer timer(PHASE_TOTAL);
+		TraceScope trace("palette " + job.opts.output, "job");
+		LogBuffer log;
+		const int maxColors = isFormat(job.textureType, PIXELFORMAT_PAL4BPP) ? 16 : 256;
+		reduceColors(job.images, maxColors, job.shared.palette, job.shared.indexedImages);
+		job.shared.images = &job.images;
+		textures.push_back(&job.shared);
+	}
+	g_stats = nullptr;
+	applyJobSettings(settings);
+
+	Palette shared;
+	if (!buildSharedPalette(textures, shared) || !shared.save(filename, paletteFormat)) {
+		return false;
+	}
+	logDebug("Saved shared palette " + filename);
+
+	const std::string bankFilename = filename + ".banks";
+	std::ofstream banks(bankFilename);
+	if (!banks.is_open()) {
+		logError("Failed to open file for writing: " + bankFilename);
+		return false;
+	}
+	for (const auto& job : jobs) {
+		if (isPaletted(job.textureType)) {
+			banks << job.opts.output << " " << job.shared.bank << "\n";
+			logDebug(job.opts.output + " uses palette bank " + std::to_string(job.shared.bank));
+		}
+	}
+	return true;
+}
+
+int main(int argc, char** argv) {
+	CommandLineOptions opts;
+	if (!parseArgs(argc, argv, opts)) {
 		return -1;
 	}
+	g_verbose = opts.verbose;
+	ThreadPool::setGlobalThreads(opts.threads);
 
-	int expectedSize = writeTextureHeader(out, images.width(), images.height(), textureType);
-	std::streampos positionBeforeData = out.tellp();
+	// The options of the command line, which also apply to the shared palette
+	JobSettings settings;
+	if (!parseJobSettings(opts, settings)) {
+		return -1;
+	}
 
-	if (isPaletted(textureType)) {
-		convertPaletted(out, images, textureType, palFilename);
+	// Every line of a batch file describes one texture
+	std::vector<TextureJob> jobs;
+	if (!opts.batch.empty()) {
+		std::ifstream batch(opts.batch);
+		if (!batch.is_open()) {
+			logError("Failed to open batch file: " + opts.batch);
+			return -1;
+		}
+		std::string line;
+		while (std::getline(batch, line)) {
+			if (line.find_first_not_of(" \t\r") == std::string::npos || line[0] == '#') continue;
+			jobs.push_back(TextureJob());
+			if (!parseBatchLine(line, opts, jobs.back().opts) || !parseJobSettings(jobs.back().opts, jobs.back().settings)) {
+				return -1;
+			}
+		}
 	} else {
-		convert16BPP(out, images, textureType);
+		jobs.push_back(TextureJob());
+		jobs.back().opts = opts;
+		jobs.back().settings = settings;
 	}
 
-	std::streampos positionAfterData = out.tellp();
-	int padding = expectedSize - (positionAfterData - positionBeforeData);
-	if (padding > 0) {
-		if (padding >= 32) logWarning("Padding is " + std::to_string(padding));
-		writeZeroes(out, padding);
-		logDebug("Added " + std::to_string(padding) + " bytes of padding");
+	if (!opts.trace.empty())
+		startTrace();
+
+	// Every job gets its own stats, which the converters find in g_stats
+	if (!opts.stats.empty()) {
+		for (auto& job : jobs)
+			job.stats.reset(new Stats());
 	}
 
-	out.close();
-	logDebug("Saved texture " + opts.output);
+	const bool sharedPalette = !opts.sharedPalette.empty();
+	auto prepare = [](TextureJob& job) {
+		applyJobSettings(job.settings);
+		g_stats = job.stats.get();
+		StatsTimer timer(PHASE_TOTAL);
+		TraceScope trace("prepare " + job.opts.output, "job");
+		LogBuffer log;
+		return prepareJob(job);
+	};
+	auto write = [sharedPalette](TextureJob& job) {
+		applyJobSettings(job.settings);
+		g_stats = job.stats.get();
+		StatsTimer timer(PHASE_TOTAL);
+		TraceScope trace("convert " + job.opts.output, "job");
+		LogBuffer log;
+		bool written = writeJob(job, sharedPalette);
+		releaseJob(job);
+		return written;
+	};
+
+	// The shared palette needs the colors of every texture, so then all of
+	// them are loaded before the first is written. Otherwise each job is
+	// written and freed before the next one is loaded.
+	if (sharedPalette) {
+		for (auto& job : jobs) {
+			if (!prepare(job)) {
+				return -1;
+			}
+		}
+		if (!saveSharedPalette(jobs, opts.sharedPalette, settings)) {
+			return -1;
+		}
+	}
 
-    std::string previewFilename = opts.preview;
-    std::string codeUsageFilename = (textureType & FLAG_COMPRESSED) ? opts.codeUsage : "";
-
-    if (!previewFilename.empty() || !codeUsageFilename.empty()) {
-        if (generatePreview(opts.output, palFilename, previewFilename, codeUsageFilename)) {
-            if (!previewFilename.empty())  std::cout << "[INFO] Saved preview image " << previewFilename << "\n";
-            if (!codeUsageFilename.empty()) std::cout << "[INFO] Saved code usage image " << codeUsageFilename << "\n";
-        } else {
-            if (!previewFilename.empty())  std::cerr << "[ERROR] Failed to save preview image " << previewFilename << "\n";
-            if (!codeUsageFilename.empty()) std::cerr << "[ERROR] Failed to save code usage image " << codeUsageFilename << "\n";
-        }
-    }
+	for (auto& job : jobs) {
+		if ((!sharedPalette && !prepare(job)) || !write(job)) {
+			return -1;
+		}
+	}
+	g_stats = nullptr;
+	applyJobSettings(settings);
+
+	if (!opts.stats.empty() && !saveStatsJson(jobs, opts.stats)) {
+		return -1;
+	}
+
+	if (!opts.trace.empty()) {
+		g_tracing = false;
+		if (!saveTrace(opts.trace)) {
+			logError("Failed to write trace " + opts.trace);
+			return -1;
+		}
+	}
+
+	if (!opts.metricsJson.empty() && !saveMetricsJson(jobs, opts.metricsJson)) {
+		return -1;
+	}
 
 	return 0;
 }
\ No newline at end of file
@@ -0,0 +1,81 @@
+#include "threadpool.h"
+
+#include <algorithm>
+#include "log.h"
+
+static thread_local bool t_insideWorker = false;
+static int g_globalThreads = 0;
+
+ThreadPool::ThreadPool(int threads) {
+	if (threads <= 0)
+		threads = std::max(1u, std::thread::hardware_concurrency());
+	for (int i=0; i<threads; i++)
+		workers.emplace_back(&ThreadPool::workerLoop, this);
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	wakeup.notify_all();
+	for (auto& worker : workers)
+		worker.join();
+}
+
+std::future<void> ThreadPool::submit(std::function<void()> task) {
+	std::packaged_task<void()> packaged(std::move(task));
+	std::future<void> result = packaged.get_future();
+
+	if (t_insideWorker) {
+		packaged();
+		return result;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		tasks.push(Task{ std::move(packaged), LogBuffer::active() });
+	}
+	wakeup.notify_one();
+	return result;
+}
+
+void ThreadPool::parallelFor(int count, const std::function<void(int)>& fn) {
+	if (count <= 1 || t_insideWorker) {
+		for (int i=0; i<count; i++) fn(i);
+		return;
+	}
+
+	std::vector<std::future<void>> results;
+	results.reserve(count);
+	for (int i=0; i<count; i++)
+		results.push_back(submit([&fn, i]() { fn(i); }));
+	for (auto& result : results)
+		result.get();
+}
+
+void ThreadPool::workerLoop() {
+	t_insideWorker = true;
+	for (;;) {
+		Task task;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			wakeup.wait(lock, [this]() { return stopping || !tasks.empty(); });
+			if (tasks.empty()) return;
+			task = std::move(tasks.front());
+			tasks.pop();
+		}
+		LogBuffer::setActive(task.log);
+		task.run();
+		LogBuffer::setActive(nullptr);
+	}
+}
+
+ThreadPool& ThreadPool::global() {
+	static ThreadPool pool(g_globalThreads);
+	return pool;
+}
+
+void ThreadPool::setGlobalThreads(int threads) {
+	g_globalThreads = threads;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+class LogBuffer;
+
+// A fixed set of worker threads taking tasks from one queue. Tasks submitted
+// from inside a worker run right away on that worker, so nested parallel
+// work can never deadlock waiting for a free thread.
+class ThreadPool {
+public:
+	// threads <= 0 uses one thread per hardware thread
+	explicit ThreadPool(int threads = 0);
+	~ThreadPool();
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	int threadCount() const { return (int)workers.size(); }
+
+	std::future<void> submit(std::function<void()> task);
+
+	// Calls fn(0) .. fn(count-1) on the pool and waits for all of them
+	void parallelFor(int count, const std::function<void(int)>& fn);
+
+	// The pool shared by the whole program. setGlobalThreads() only has an
+	// effect before the first call to global().
+	static ThreadPool& global();
+	static void setGlobalThreads(int threads);
+
+private:
+	// A task and the LogBuffer that was active where it was submitted
+	struct Task {
+		std::packaged_task<void()> run;
+		LogBuffer* log;
+	};
+
+	void workerLoop();
+
+	std::vector<std::thread> workers;
+	std::queue<Task> tasks;
+	std::mutex mutex;
+	std::condition_variable wakeup;
+	bool stopping = false;
+};
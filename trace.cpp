@@ -0,0 +1,89 @@
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "trace.h"
+
+bool g_tracing = false;
+
+namespace {
+
+struct TraceEvent {
+	std::string name;
+	const char* category;
+	int64_t start;		// Microseconds since startTrace()
+	int64_t duration;
+};
+
+struct ThreadEvents {
+	int id;
+	std::vector<TraceEvent> events;
+};
+
+std::mutex threadsMutex;
+std::vector<std::unique_ptr<ThreadEvents>> threads;
+std::chrono::steady_clock::time_point traceStart;
+thread_local ThreadEvents* t_events = nullptr;
+
+}
+
+// The event list of the calling thread, registered on first use
+static ThreadEvents& threadEvents() {
+	if (!t_events) {
+		std::lock_guard<std::mutex> lock(threadsMutex);
+		threads.emplace_back(new ThreadEvents());
+		t_events = threads.back().get();
+		t_events->id = (int)threads.size() - 1;
+	}
+	return *t_events;
+}
+
+void startTrace() {
+	traceStart = std::chrono::steady_clock::now();
+	threadEvents();
+	g_tracing = true;
+}
+
+void traceEvent(const std::string& name, const char* category,
+				std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end) {
+	using std::chrono::duration_cast;
+	using std::chrono::microseconds;
+	TraceEvent event;
+	event.name = name;
+	event.category = category;
+	event.start = duration_cast<microseconds>(start - traceStart).count();
+	event.duration = duration_cast<microseconds>(end - start).count();
+	threadEvents().events.push_back(std::move(event));
+}
+
+static std::string jsonString(const std::string& s) {
+	std::string out = "\"";
+	for (char c : s) {
+		if (c == '"' || c == '\\') out += '\\';
+		out += c;
+	}
+	return out + "\"";
+}
+
+bool saveTrace(const std::string& filename) {
+	std::ofstream file(filename);
+	if (!file.is_open())
+		return false;
+
+	std::lock_guard<std::mutex> lock(threadsMutex);
+	file << "{\"traceEvents\": [\n";
+	bool first = true;
+	for (const auto& thread : threads) {
+		std::string threadName = thread->id == 0 ? "main" : "worker " + std::to_string(thread->id);
+		file << (first ? "" : ",\n") << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << thread->id
+			 << ", \"args\": {\"name\": " << jsonString(threadName) << "}}";
+		first = false;
+		for (const auto& event : thread->events) {
+			file << ",\n{\"name\": " << jsonString(event.name) << ", \"cat\": \"" << event.category
+				 << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << thread->id
+				 << ", \"ts\": " << event.start << ", \"dur\": " << event.duration << "}";
+		}
+	}
+	file << "\n], \"displayTimeUnit\": \"ms\"}\n";
+	return file.good();
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <chrono>
+#include <string>
+
+// Chrome trace event recording (chrome://tracing, Perfetto). Every thread
+// keeps its own list of events, so recording never takes a lock. When
+// tracing is off, the cost of a traced scope is one flag check.
+
+// Set by startTrace(). Only changed while no conversion work is running.
+extern bool g_tracing;
+
+// Starts recording. The calling thread shows up as "main".
+void startTrace();
+
+// Writes everything recorded so far as a JSON trace file. Must not be
+// called while other threads may still record events.
+bool saveTrace(const std::string& filename);
+
+// Records one complete event on the calling thread
+void traceEvent(const std::string& name, const char* category,
+				std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end);
+
+// Records an event for the time until it goes out of scope
+class TraceScope {
+public:
+	TraceScope(const std::string& name, const char* category) {
+		if (g_tracing) {
+			this->name = name;
+			this->category = category;
+			start = std::chrono::steady_clock::now();
+		}
+	}
+	~TraceScope() {
+		if (g_tracing && category)
+			traceEvent(name, category, start, std::chrono::steady_clock::now());
+	}
+
+	TraceScope(const TraceScope&) = delete;
+	TraceScope& operator=(const TraceScope&) = delete;
+
+private:
+	std::string name;
+	const char* category = nullptr;
+	std::chrono::steady_clock::time_point start;
+};
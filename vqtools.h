@@ -8,11 +8,38 @@
 #include <chrono>
 #include <cmath>
 #include <algorithm>
+#include <cstring>
+#include <random>
+#include <functional>
+#include <limits>
+#include <queue>
+
+#include "stats.h"
 
 typedef uint32_t uint;
 
 enum FilterMode {
-    NEAREST, BILINEAR
+    NEAREST, BILINEAR, BOX, TRIANGLE, LANCZOS
+};
+
+// How VectorQuantizer::compress() builds its initial codebook.
+enum VQInitMode {
+    VQ_INIT_SPLIT,      // LBG: double the codebook by splitting, then repair
+    VQ_INIT_KMEANSPP    // Weighted k-means++ seeding of all codes in one pass
+};
+
+// How a code is split in two when the codebook grows.
+enum VQSplitMode {
+    VQ_SPLIT_PERTURB,   // Nudge both halves 0.01 apart towards the furthest vector
+    VQ_SPLIT_PRINCIPAL  // Place both halves along the cluster's principal axis
+};
+
+struct VQOptions {
+    VQInitMode initMode = VQ_INIT_SPLIT;
+    VQSplitMode splitMode = VQ_SPLIT_PERTURB;
+    uint32_t seed = 0;  // Only used by randomized init modes and sampling
+    int maxTrainingVectors = 0; // Train on a sample of at most this many input vectors, 0 = all
+    int timeBudgetMs = 0;       // Stop refining after this many ms, 0 = no limit
 };
 
 struct RGBA {
@@ -211,21 +238,56 @@ public:
         int vecCount = 0;
         float maxDistance = 0;
         Vec<N> maxDistanceVec;
+        double distortion = 0;  // Total squared error of the vectors placed here
+        std::vector<float> covariance; // NxN, only kept for VQ_SPLIT_PRINCIPAL
+
+        // Vec leaves its components uninitialized, so a new code starts out zeroed
+        Code() { codeVec.zero(); vecSum.zero(); maxDistanceVec.zero(); }
+    };
+
+    // Reported to the progress callback after every refinement pass.
+    struct Progress {
+        const char* phase;  // "seed", "split" or "repair"
+        int codes;
+        int targetCodes;
+        double distortion;  // Total squared error of the last pass
+        int64_t elapsedMs;
     };
 
     std::vector<Code> codes;
+    VQOptions options;
+
+    // Distances computed by findClosest(), added to g_stats on destruction.
+    // Keeping the count here keeps atomics out of the search loop.
+    mutable int64_t distanceEvaluations = 0;
+
+    VectorQuantizer() = default;
+    VectorQuantizer(const VectorQuantizer&) = delete;
+    VectorQuantizer& operator=(const VectorQuantizer&) = delete;
+    ~VectorQuantizer() { countStat(COUNTER_DISTANCES, distanceEvaluations); }
+
+    // Optional. Return false to cancel; compress() then keeps the best codebook found so far.
+    std::function<bool(const Progress&)> progress;
+
+    // Optional. Receives a line about every step compress() takes, such as
+    // "Split 3 done. Codes: 8".
+    std::function<void(const std::string&)> message;
 
     int codeCount() const { return (int)codes.size(); }
     const Vec<N>& codeVector(int i) const { return codes[i].codeVec; }
 
     int findClosest(const Vec<N>& vec) const;
-    int findBestSplitCandidate() const;
     void removeUnusedCodes();
-    void place(const std::unordered_map<Vec<N>,int>& vecs);
+    double place(const std::unordered_map<Vec<N>,int>& vecs);
+    void seedKMeansPP(const std::unordered_map<Vec<N>,int>& vecs, int numCodes);
+    void sampleTrainingSet(const std::vector<Vec<N>>& vectors, int maxVecs, std::unordered_map<Vec<N>,int>& sample) const;
     void split();
     void splitCode(int index);
     void compress(const std::vector<Vec<N>>& vectors,int numCodes);
     bool writeReportToFile(const std::string& filename);
+
+private:
+    void report(const std::string& line) const { if (message) message(line); }
 };
 
 inline uint32_t packColor(const RGBA& c) {
@@ -287,25 +349,16 @@ int VectorQuantizer<N>::findClosest(const Vec<N>& vec) const {
         if(d < closestDist){
             closestDist=d;
             closestIndex=(int)i;
-            if (closestDist < 0.0001f) return closestIndex;
+            if (closestDist < 0.0001f) {
+                distanceEvaluations += i + 1;
+                return closestIndex;
+            }
         }
     }
+    distanceEvaluations += codes.size();
     return closestIndex;
 }
 
-template<uint N>
-int VectorQuantizer<N>::findBestSplitCandidate() const {
-    int idx=-1;
-    float furthest=0;
-    for(size_t i=0;i<codes.size();i++){
-        if(codes[i].vecCount>1 && codes[i].maxDistance>furthest){
-            furthest=codes[i].maxDistance;
-            idx=(int)i;
-        }
-    }
-    return idx;
-}
-
 template<uint N>
 void VectorQuantizer<N>::removeUnusedCodes() {
     size_t oldSize=codes.size();
@@ -315,17 +368,25 @@ void VectorQuantizer<N>::removeUnusedCodes() {
         codes.end()
     );
     if(codes.size()<oldSize){
-        std::cout<<"Removed "<<(oldSize-codes.size())<<" unused codes\n";
+        report("Removed "+std::to_string(oldSize-codes.size())+" unused codes");
     }
 }
 
+// Assigns every vector to its closest code and moves each code to the centroid
+// of its vectors. Returns the total (weighted) squared error of the assignment.
 template<uint N>
-void VectorQuantizer<N>::place(const std::unordered_map<Vec<N>,int>& vecs) {
+double VectorQuantizer<N>::place(const std::unordered_map<Vec<N>,int>& vecs) {
+    StatsTimer timer(PHASE_VQ_REFINE);
+    countStat(COUNTER_PLACE_PASSES, 1);
+    const bool principal=(options.splitMode==VQ_SPLIT_PRINCIPAL);
+    double distortion=0;
     for(auto& code:codes){
         code.vecCount=0;
         code.vecSum.zero();
         code.maxDistance=0;
         code.maxDistanceVec.zero();
+        code.distortion=0;
+        if(principal) code.covariance.assign(N*N,0.0f);
     }
 
     for(const auto& kv:vecs){
@@ -337,22 +398,147 @@ void VectorQuantizer<N>::place(const std::unordered_map<Vec<N>,int>& vecs) {
         code.vecCount+=count;
 
         float dist=Vec<N>::distanceSquared(code.codeVec,vec);
+        distortion+=(double)dist*count;
+        code.distortion+=(double)dist*count;
         if(dist>code.maxDistance){
             code.maxDistance=dist;
             code.maxDistanceVec=vec;
         }
+
+        // Scatter around the current code vector (upper triangle only). Taking
+        // it around the code rather than the origin keeps float precision.
+        if(principal){
+            Vec<N> d=vec-code.codeVec;
+            float* row=code.covariance.data();
+            for(uint i=0;i<N;i++,row+=N){
+                const float di=d[i]*count;
+                for(uint j=i;j<N;j++) row[j]+=di*d[j];
+            }
+        }
     }
 
     for(auto& code:codes){
         if(code.vecCount>0){
             code.vecSum /= (float)code.vecCount;
+            if(principal){
+                // Turn the scatter into the covariance around the new centroid
+                Vec<N> delta=code.vecSum-code.codeVec;
+                float* c=code.covariance.data();
+                for(uint i=0;i<N;i++){
+                    for(uint j=i;j<N;j++){
+                        float v=c[i*N+j]/code.vecCount-delta[i]*delta[j];
+                        c[i*N+j]=v;
+                        c[j*N+i]=v;
+                    }
+                }
+            }
             code.codeVec=code.vecSum;
         }
     }
+    return distortion;
+}
+
+// Power iteration for the dominant eigenvector of the symmetric NxN matrix m.
+// 'axis' holds the start vector on entry and the unit eigenvector on return.
+// Returns the corresponding eigenvalue.
+template<uint N>
+float dominantAxis(const std::vector<float>& m, Vec<N>& axis) {
+    if(axis.lengthSquared()<1e-12f)
+        for(uint i=0;i<N;i++) axis[i]=1.0f;
+    axis.normalize();
+
+    float eigenvalue=0;
+    for(int iteration=0;iteration<12;iteration++){
+        Vec<N> next;
+        for(uint i=0;i<N;i++){
+            const float* row=&m[i*N];
+            float sum=0;
+            for(uint j=0;j<N;j++) sum+=row[j]*axis[j];
+            next[i]=sum;
+        }
+        eigenvalue=next.length();
+        if(eigenvalue<1e-12f) return 0;
+        next/=eigenvalue;
+        axis=next;
+    }
+    return eigenvalue;
+}
+
+// Picks up to numCodes initial codes using weighted k-means++: each new code is
+// drawn with probability proportional to count * squared distance to the
+// closest code chosen so far. Deterministic for a given options.seed.
+template<uint N>
+void VectorQuantizer<N>::seedKMeansPP(const std::unordered_map<Vec<N>,int>& vecs, int numCodes) {
+    StatsTimer timer(PHASE_VQ_SEED);
+    std::vector<const Vec<N>*> points;
+    std::vector<double> weights;
+    points.reserve(vecs.size());
+    weights.reserve(vecs.size());
+    for(const auto& kv:vecs){
+        points.push_back(&kv.first);
+        weights.push_back(kv.second);
+    }
+
+    codes.clear();
+    if(points.empty()) return;
+
+    std::mt19937 rng(options.seed);
+    auto pick=[&](const std::vector<double>& w, double total){
+        double r=(rng()/4294967296.0)*total;
+        for(size_t i=0;i<w.size();i++){
+            r-=w[i];
+            if(r<0) return i;
+        }
+        return w.size()-1;
+    };
+
+    double total=0;
+    for(double w:weights) total+=w;
+
+    std::vector<double> nearest(points.size());
+    std::vector<double> score(points.size());
+    size_t chosen=pick(weights,total);
+    for(int k=0;k<numCodes;k++){
+        Code code = Code();
+        code.codeVec=*points[chosen];
+        codes.push_back(code);
+
+        total=0;
+        for(size_t i=0;i<points.size();i++){
+            double d=Vec<N>::distanceSquared(*points[i],code.codeVec);
+            if(k==0 || d<nearest[i]) nearest[i]=d;
+            score[i]=nearest[i]*weights[i];
+            total+=score[i];
+        }
+
+        // Every vector already coincides with a code
+        if(total<=0) break;
+        chosen=pick(score,total);
+    }
+}
+
+// Counts a systematic sample of at most maxVecs of the input vectors: every
+// step-th vector from a random start. Frequent vectors are picked in
+// proportion to how often they occur, and the number of times a vector was
+// picked becomes its count. Only the sample is ever counted, so the training
+// set stays within maxVecs entries however large the input is.
+template<uint N>
+void VectorQuantizer<N>::sampleTrainingSet(const std::vector<Vec<N>>& vectors, int maxVecs, std::unordered_map<Vec<N>,int>& sample) const {
+    std::mt19937 rng(options.seed);
+    const double step=(double)vectors.size()/maxVecs;
+    double next=(rng()/4294967296.0)*step;
+
+    sample.clear();
+    sample.reserve(maxVecs);
+    for(size_t i=(size_t)next;i<vectors.size();i=(size_t)next){
+        sample[vectors[i]]++;
+        next+=step;
+    }
 }
 
 template<uint N>
 void VectorQuantizer<N>::split() {
+    StatsTimer timer(PHASE_VQ_SPLIT);
     int SIZE=(int)codes.size();
     for(int i=0;i<SIZE;i++){
         if(codes[i].vecCount>1){
@@ -365,11 +551,20 @@ template<uint N>
 void VectorQuantizer<N>::splitCode(int index) {
     Code& code=codes[index];
     Vec<N> diff=code.maxDistanceVec-code.codeVec;
-    diff.setLength(0.01f);
+    float variance=0;
+    if(options.splitMode==VQ_SPLIT_PRINCIPAL && !code.covariance.empty())
+        variance=dominantAxis(code.covariance,diff);
+    if(variance>0){
+        // For a roughly Gaussian cluster, the centroids of the two halves split
+        // at the mean lie about 0.8 standard deviations from it.
+        diff.setLength(0.8f*std::sqrt(variance));
+    } else {
+        diff.setLength(0.01f);
+    }
     Vec<N> newVec=code.codeVec;
     for(uint i=0;i<N;i++) newVec[i]+=diff[i];
     for(uint i=0;i<N;i++) code.codeVec[i]-=diff[i];
-    Code newCode;
+    Code newCode = Code();
     newCode.codeVec=newVec;
     codes.push_back(newCode);
 }
@@ -379,51 +574,144 @@ void VectorQuantizer<N>::compress(const std::vector<Vec<N>>& vectors,int numCode
     using clock=std::chrono::steady_clock;
     auto start=clock::now();
 
+    // Train on a bounded sample of the input if requested, which is counted
+    // without ever counting all of the input. The caller still maps every input
+    // vector to its closest code afterwards.
     std::unordered_map<Vec<N>,int> rle;
-    for(const auto& v:vectors) rle[v]++;
-
-    std::cout<<"RLE result: "<<vectors.size()<<" => "<<rle.size()<<"\n";
+    if(options.maxTrainingVectors>0 && vectors.size()>(size_t)options.maxTrainingVectors){
+        sampleTrainingSet(vectors,options.maxTrainingVectors,rle);
+        report("Training on "+std::to_string(rle.size())+" unique vectors sampled from "+std::to_string(vectors.size()));
+    } else {
+        for(const auto& v:vectors) rle[v]++;
+        report("RLE result: "+std::to_string(vectors.size())+" => "+std::to_string(rle.size()));
+    }
+    countStat(COUNTER_UNIQUE_VECTORS, rle.size());
+
+    // Called after every refinement pass. Remembers the codebook with the lowest
+    // distortion seen so far, so stopping early on the time budget or on request
+    // of the progress callback still leaves a usable codebook behind. Only the
+    // vectors and counts of the used codes are kept, not whole codes.
+    const bool anytime=(options.timeBudgetMs>0) || (bool)progress;
+    std::vector<Vec<N>> bestVecs;
+    std::vector<int> bestCounts;
+    double bestDistortion=std::numeric_limits<double>::max();
+    bool stopped=false;
+    auto checkpoint=[&](const char* phase,double distortion){
+        if(!anytime) return true;
+        if(distortion<bestDistortion){
+            bestDistortion=distortion;
+            bestVecs.clear();
+            bestCounts.clear();
+            for(const auto& code:codes){
+                if(code.vecCount==0) continue;
+                bestVecs.push_back(code.codeVec);
+                bestCounts.push_back(code.vecCount);
+            }
+        }
+        Progress p;
+        p.phase=phase;
+        p.codes=(int)codes.size();
+        p.targetCodes=numCodes;
+        p.distortion=distortion;
+        p.elapsedMs=std::chrono::duration_cast<std::chrono::milliseconds>(clock::now()-start).count();
+        if(progress && !progress(p)){
+            report("Compression cancelled");
+            stopped=true;
+        } else if(options.timeBudgetMs>0 && p.elapsedMs>=options.timeBudgetMs){
+            report("Time budget of "+std::to_string(options.timeBudgetMs)+" ms exhausted");
+            stopped=true;
+        }
+        return !stopped;
+    };
 
-    codes.clear();
-    codes.resize(1);
-    codes.reserve(numCodes);
-    place(rle);
+    // Principal-axis splits already start the halves close to their final
+    // centroids, so a single Lloyd pass per round is enough.
+    const int refinePasses=(options.splitMode==VQ_SPLIT_PRINCIPAL) ? 1 : 3;
 
     int splits=0, repairs=0;
-    while((int)(codes.size()*2)<=numCodes){
+    if(options.initMode==VQ_INIT_KMEANSPP){
+        seedKMeansPP(rle,numCodes);
+        report("Seeded "+std::to_string(codes.size())+" codes");
+
+        // Lloyd refinement until the distortion stops improving noticeably
+        double last=place(rle);
+        for(int pass=1;pass<16 && checkpoint("seed",last);pass++){
+            double distortion=place(rle);
+            if(last-distortion<=last*0.001) break;
+            last=distortion;
+        }
+        removeUnusedCodes();
+    } else {
+        codes.clear();
+        codes.resize(1);
+        codes.reserve(numCodes);
+        checkpoint("split",place(rle));
+    }
+
+    while(!stopped && options.initMode==VQ_INIT_SPLIT && (int)(codes.size()*2)<=numCodes){
         size_t before=codes.size();
         split();
-        place(rle); place(rle); place(rle);
+        for(int pass=0;pass<refinePasses;pass++)
+            if(!checkpoint("split",place(rle))) break;
         removeUnusedCodes();
+        if(stopped) break;
 
         if(codes.size()==before){
-            std::cout<<"No further improvement by splitting\n";
+            report("No further improvement by splitting");
             break;
         }
         splits++;
-        std::cout<<"Split "<<splits<<" done. Codes: "<<codes.size()<<"\n";
+        report("Split "+std::to_string(splits)+" done. Codes: "+std::to_string(codes.size()));
     }
 
-    while((int)codes.size()<numCodes){
+    while(!stopped && (int)codes.size()<numCodes){
         size_t before=codes.size();
-        int n=numCodes-before;
-        for(int i=0;i<n;i++){
-            int idx=findBestSplitCandidate();
-            if(idx==-1) break;
-            splitCode(idx);
-            codes[idx].maxDistance=0;
+
+        // Fill the missing codes by splitting the codes that contribute the
+        // most error, largest first.
+        {
+            StatsTimer timer(PHASE_VQ_REPAIR);
+            std::vector<std::pair<double,int>> heap;
+            for(size_t i=0;i<before;i++)
+                if(codes[i].vecCount>1 && codes[i].maxDistance>0)
+                    heap.push_back(std::make_pair(codes[i].distortion,(int)i));
+            std::priority_queue<std::pair<double,int>> candidates(std::less<std::pair<double,int>>(),std::move(heap));
+
+            int n=numCodes-before;
+            for(int i=0;i<n && !candidates.empty();i++){
+                splitCode(candidates.top().second);
+                candidates.pop();
+            }
         }
         if(codes.size()==before){
-            std::cout<<"No further improvement by repairing\n";
+            report("No further improvement by repairing");
             break;
         }
-        place(rle); place(rle); place(rle);
+        for(int pass=0;pass<refinePasses;pass++)
+            if(!checkpoint("repair",place(rle))) break;
         removeUnusedCodes();
+        if(stopped) break;
+
+        // All new codes ended up unused, so every vector already has a code
+        if(codes.size()<=before){
+            report("No further improvement by repairing");
+            break;
+        }
         repairs++;
-        std::cout<<"Repair "<<repairs<<" done. Codes: "<<codes.size()<<"\n";
+        report("Repair "+std::to_string(repairs)+" done. Codes: "+std::to_string(codes.size()));
     }
+
+    if(stopped && !bestVecs.empty()){
+        codes.assign(bestVecs.size(),Code());
+        for(size_t i=0;i<bestVecs.size();i++){
+            codes[i].codeVec=bestVecs[i];
+            codes[i].vecCount=bestCounts[i];
+        }
+        report("Using best codebook so far. Codes: "+std::to_string(codes.size()));
+    }
+
     auto ms=std::chrono::duration_cast<std::chrono::milliseconds>(clock::now()-start).count();
-    std::cout<<"Compression completed in "<<ms<<" ms\n";
+    report("Compression completed in "+std::to_string(ms)+" ms");
 }
 
 template<uint N>